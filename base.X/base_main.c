@@ -27,16 +27,6 @@
 #pragma config WRT = OFF        // Flash Program Memory Self Write Enable bits (Write protection off)
 
 // Global Defines
-// RC Modules
-enum Buttons {BUTTON_STOP, BUTTON_UP, BUTTON_LEFT, BUTTON_RIGHT, BUTTON_DOWN, BUTTON_OK, BUTTON_ZERO};
-enum RC_States {RC_RESET, RC_START_FALL, RC_START_RISE, RC_RECV_FALL, RC_RECV_RISE, RC_CONT_FALL1, RC_CONT_RISE1, RC_CONT_FALL2, RC_CONT_RISE2};
-#define RC_Void_Threshold 27500 // 110ms * 1000us/ms * 1/4
-#define RC_Start_Low_Threshold 2200 // 8.8ms * 1000us/ms * 1/4
-#define RC_Start_Idle_Threshold 1000 // 4ms * 1000us/ms * 1/4
-#define RC_Data_Low_Threshold 1// maybe not need, to be larger than measured
-#define RC_Data_Zero_Threshold 375 // 1.5ms * 1000us/ms * 1/4
-#define RC_Cont_Idle_Threshold 500 // 2ms * 1000us/ms * 1/4 to be smaller than measured
-
 // MC Module
 enum Motions {CMD_STOP, CMD_FORWARD, CMD_LEFT, CMD_RIGHT, CMD_BACKWARD};
 enum MC_Command_Outputs {STOP = 0, FORWARD = 0b0101, BACKWARD = 0b1010, TURN_LEFT = 0b0110, TURN_RIGHT = 0b1001};
@@ -53,20 +43,76 @@ enum MC_Command_Outputs {STOP = 0, FORWARD = 0b0101, BACKWARD = 0b1010, TURN_LEF
 // Trigger
 #define pull_trigger RC5
 
+// IR Capture
+#define RC_CAPTURE_SIZE 72 // Edges, a 68 edge frame plus its first repeat code
+#define RC_CAPTURE_COMMAND 'C'
+#define UART_9600_BAUD 51 // 8MHz / (16 * (51 + 1)) = 9615 baud with BRGH = 1
+enum Capture_States {CAPTURE_IDLE, CAPTURE_RECORDING, CAPTURE_SENDING};
+
+// Events
+// Posted by the ISR, each handled and cleared by main()
+#define EV_MS_PR2 124 // 8MHz / 4 / 16 / (124 + 1) = 1kHz Timer2 tick
+
 // Function Prototypes
-char RC_return_key(void);
 void MC_set_motion(char);
+void RC_keys(void);
+void capture_command(char);
+void capture_service(void);
+char RC_capture_byte(unsigned char);
 void interrupt interrupt_handler(void);
 
 // Global Variables
+// ISR Hot State
+// Everything the ISR touches lives in common RAM (0x74-0x7B, visible from every
+// bank) or in bank 0 next to the SFRs it works with, so the ISR body needs no
+// bank selects. That rules out the bank 1 PIE bits: the enables stay on, the
+// RC void timer is armed by a bit here instead, the ISR drains RCREG and the
+// transmitter is polled. The IR capture buffer is the one exception, it only
+// pays its bank selects while a capture runs. 0x70-0x73 and 0x7C-0x7F are left
+// to the compiler for its temporaries and the interrupt context save.
+// Absolute objects are not cleared by the runtime startup, see main().
+typedef union {
+    struct {
+        unsigned RC_level : 1;
+        unsigned RC_ready : 1;
+        unsigned RC_capture : 1;
+        unsigned ev_rc_edge : 1;
+        unsigned ev_rc_void : 1;
+        unsigned ev_uart : 1;
+        unsigned ev_ms : 1;
+        unsigned rc_void_armed : 1;
+    };
+    char all;
+} ISR_Flags;
+ISR_Flags ISR_flags @ 0x74;
+#define last_RC_data ISR_flags.RC_level
+#define RC_data_ready ISR_flags.RC_ready
+#define RC_capturing ISR_flags.RC_capture
+#define EV_rc_edge ISR_flags.ev_rc_edge // RB2 changed
+#define EV_rc_void ISR_flags.ev_rc_void // No RB2 edge for RC_Void_Threshold, CCP2 times it
+#define EV_uart ISR_flags.ev_uart // A byte from the host is in UART_rx
+#define EV_ms ISR_flags.ev_ms // Timer2, every 1ms
+#define RC_void_armed ISR_flags.rc_void_armed // The next CCP2 match posts EV_rc_void
+
+// System Tick
+// Timer1 extended to 32 bits by counting its overflows, wraps after 4.7 hours.
+// 4us per Timer1 tick, the RC thresholds are in ticks.
+unsigned int SYS_tick_high @ 0x7A; // Timer1 overflows, the upper half of the tick
+
 // RC Module
-char RC_State = 0;
-char RC_index = 0;
-char RC_data[3];
-unsigned int last_RC_time;
-unsigned int last_critical_RC_time;
-bit last_RC_data;
-bit RC_data_ready = 0;
+unsigned long last_RC_time @ 0x75; // System tick of the latest RB2 edge
+char UART_rx @ 0x79; // Read by the ISR, which clears RCIF without masking RCIE
+#include "rc_decoder.h" // Needs last_RC_time, last_RC_data and RC_data_ready above
+
+// IR Capture
+// Raw RB2 edges as TMR1 time, with the level in bit 0 (8us resolution). The
+// ISR writes them, so they are placed: one half each in banks 1 and 2, the
+// count in bank 0.
+unsigned char RC_capture_lo[RC_CAPTURE_SIZE] @ 0xA0;
+unsigned char RC_capture_hi[RC_CAPTURE_SIZE] @ 0x120;
+unsigned char RC_capture_count @ 0x20;
+unsigned char RC_capture_sent;
+char capture_state = CAPTURE_IDLE;
 
 // MC Module
 char last_motion = CMD_STOP;
@@ -74,8 +120,14 @@ char RC_key;
 char last_RC_key; // This is debouncing for mode switching (one press yields one switch)
 
 void main(void) {
-    // Init RC4 and RC5 for mode and trigger
-    TRISC = 0;
+    // Absolute objects are not cleared by the runtime startup
+    ISR_flags.all = 0;
+    SYS_tick_high = 0;
+    UART_rx = 0;
+    RC_capture_count = 0;
+    
+    // Init RC4 and RC5 for mode and trigger, RC7 is the UART receiver
+    TRISC = 0b10000000;
     PORTC = 0;
     
     // Init RD1:0 for top's motion control signal
@@ -104,6 +156,8 @@ void main(void) {
     TMR1GE = 0; TMR1ON = 1; 			//Enable TIMER1 (See Fig. 6-1 TIMER1 Block Diagram in PIC16F887 Data Sheet)
 	TMR1CS = 0; 					//Select internal clock whose frequency is Fosc/4, where Fosc = 8 MHz
 	T1CKPS1 = 1; T1CKPS0 = 1; 		 	//Set prescale to divide by 4 yielding a clock tick period of 2 microseconds
+    TMR1IF = 0;
+    TMR1IE = 1; // Overflows extend Timer1 to the 32-bit system tick
     last_RC_time = TMR1;
     
     // Init CCPR1
@@ -115,164 +169,151 @@ void main(void) {
     CCP1IE = 1;
     CCPR1 = TMR1 + 10;
     
+    // Init CCP2 as the RC void timer, the ISR arms it on every RB2 edge
+    CCP2M3 = 1; CCP2M2 = 0; CCP2M1 = 1; CCP2M0 = 0;
+    CCP2IF = 0;
+    CCP2IE = 1; // Always on, RC_void_armed decides whether a match counts
+    
+    // Init Timer 2 for the 1ms event tick
+    PR2 = EV_MS_PR2;
+    T2CKPS1 = 1; T2CKPS0 = 0; // Prescale 16
+    TMR2IF = 0;
+    TMR2IE = 1;
+    TMR2ON = 1;
+    
+    // Init UART for IR capture, 9600 8N1
+    SPBRG = UART_9600_BAUD;
+    BRGH = 1;
+    SYNC = 0;
+    SPEN = 1;
+    TXEN = 1;
+    CREN = 1;
+    RCIE = 1;
+    
     // Turn on Interrupts
     PEIE = 1;
 	GIE = 1;
     
-    unsigned int last_critical_difference;
-    unsigned int last_RC_time_backup;
+    char state;
     
     while (1) {
-        // RC state transition
-        if (((signed int) (TMR1 - last_RC_time)) > RC_Void_Threshold) {
-            RC_State = RC_RESET;
-            RC_index = 0;
-            RC_data_ready = 0;
-        } else {
-            // Remember to update RC_index
-            switch (RC_State) {
-                case RC_RESET:
-                    if (last_RC_data == 0) {
-                        last_critical_RC_time = last_RC_time;
-                        RC_State = RC_START_FALL;
-                    }
-                    break;
-                case RC_START_FALL:
-                    if (last_RC_data == 1) {
-                        last_RC_time_backup = last_RC_time;
-                        last_critical_difference = last_RC_time_backup - last_critical_RC_time;
-                        if (last_critical_difference > RC_Start_Low_Threshold) {
-                            last_critical_RC_time = last_RC_time_backup;
-                            RC_State = RC_START_RISE;
-                        } else {
-                            RC_State = RC_RESET;
-                        }
-                    }
-                    break;
-                case RC_START_RISE:
-                    if (last_RC_data == 0) {
-                        last_RC_time_backup = last_RC_time;
-                        last_critical_difference = last_RC_time_backup - last_critical_RC_time;
-                        if (last_critical_difference > RC_Start_Idle_Threshold) {
-                            last_critical_RC_time = last_RC_time_backup;
-                            RC_State = RC_RECV_FALL;
-                        } else {
-                            RC_State = RC_RESET;
-                        }
-                    }
-                    break;
-                case RC_RECV_FALL:
-                    if (last_RC_data == 1) {
-                        RC_State = RC_RECV_RISE;
-                    }
-                    break;
-                case RC_RECV_RISE:
-                    if (last_RC_data == 0) {
-                        last_RC_time_backup = last_RC_time;
-                        if (RC_index == 32) {
-                            RC_State = RC_CONT_FALL1;
-                            RC_data_ready = 1;
-                        } else {
-                            last_critical_difference = last_RC_time_backup - last_critical_RC_time;
-                            if ((16 <= RC_index) & (RC_index <= 18)) { // We only need first 3 bits
-                                if (last_critical_difference < RC_Data_Zero_Threshold) {
-                                    RC_data[RC_index-16] = 0;
-                                } else {
-                                    RC_data[RC_index-16] = 1;
-                                }
-                            }
-                            last_critical_RC_time = last_RC_time_backup;
-                            RC_index++;
-                            RC_State = RC_RECV_FALL;
-                            RC_data_ready = 0;
-                        }
-                    }
-                    break;
-                case RC_CONT_FALL1:
-                    if (last_RC_data == 1) {
-                        last_RC_time_backup = last_RC_time;
-                        last_critical_difference = last_RC_time_backup - last_critical_RC_time;
-                        if (last_critical_difference > RC_Start_Low_Threshold) {
-                            last_critical_RC_time = last_RC_time_backup;
-                            RC_State = RC_CONT_RISE1;
-                        } else {
-                            RC_State = RC_CONT_RISE2;
-                        }
-                    }
-                    break;
-                case RC_CONT_RISE1:
-                    if (last_RC_data == 0) {
-                        last_RC_time_backup = last_RC_time;
-                        last_critical_difference = last_RC_time_backup - last_critical_RC_time;
-                        if (last_critical_difference > RC_Start_Idle_Threshold) {
-                            // Starting a new session
-                            last_critical_RC_time = last_RC_time_backup;
-                            RC_State = RC_RECV_FALL;
-                            RC_index = 0;
-                        } else if (last_critical_difference > RC_Cont_Idle_Threshold) {
-                            // Keep current session
-                            last_critical_RC_time = last_RC_time_backup;
-                            RC_State = RC_CONT_FALL2;
-                        } // Another else can be added for debugging purposes
-                    }
-                    break;
-                case RC_CONT_FALL2:
-                    if (last_RC_data == 1) {
-                        RC_State = RC_CONT_RISE2; // Won't work if there is interference
-                    }
-                    break;
-                case RC_CONT_RISE2:
-                    if (last_RC_data == 0) {
-                        last_critical_RC_time = last_RC_time;
-                        RC_State = RC_CONT_FALL1; // Won't work if there is interference
-                    }
+        if (EV_rc_edge) {
+            EV_rc_edge = 0;
+            // RC state transition, step until the FSM settles on the latest edge
+            do {
+                state = RC_State;
+                RC_step();
+            } while (RC_State != state);
+            RC_keys();
+        }
+        
+        if (EV_rc_void) {
+            EV_rc_void = 0;
+            RC_reset();
+            if (RC_capture_count != 0) {
+                RC_capturing = 0; // The captured frame has gone quiet
             }
+            RC_keys();
         }
-        last_RC_key = RC_key;
-        RC_key = RC_return_key();
-        // Update mode
-        if ((RC_key == BUTTON_ZERO) & (last_RC_key != BUTTON_ZERO)) {
-            mode = ~mode;
+        
+        if (EV_uart) {
+            EV_uart = 0;
+            capture_command(UART_rx);
         }
         
-        // Update pull_trigger
-        pull_trigger = (RC_key == BUTTON_OK);
+        // RD1:0 have no change interrupt, so top's command is polled, and
+        // the UART transmitter has no interrupt the ISR can mask from bank 0
+        if (EV_ms) {
+            EV_ms = 0;
+            if (mode) {
+                MC_set_motion(MC_TOP_COMMAND_OUT);
+            }
+            capture_service();
+        }
         
-        if (mode) {
-            // auto
-            MC_set_motion(MC_TOP_COMMAND_OUT);
-        } else {
-            // manual
-            MC_set_motion(((RC_key == BUTTON_ZERO) | RC_key == BUTTON_OK) ? BUTTON_STOP : RC_key);
+        // Nothing posted: sleep if nothing needs the clock. Timer1 and Timer2
+        // run from Fosc and stop in sleep, so the system tick pauses and the
+        // motor PWM holds, harmless with the motors stopped and the decoder
+        // reset. RB2 and the UART start bit wake it; with GIE off it carries on
+        // here and the ISR runs at ei(), so no event is missed in between.
+        di();
+        if ((EV_rc_edge | EV_rc_void | EV_uart | EV_ms) == 0) {
+            if ((mode == 0) & (last_motion == CMD_STOP) & (capture_state == CAPTURE_IDLE) & (RC_void_armed == 0)) {
+                WUE = 1; // The byte that wakes us is not received
+                SLEEP();
+                WUE = 0;
+            }
         }
+        ei();
+    }
+}
+
+// Act on the decoded key
+void RC_keys() {
+    last_RC_key = RC_key;
+    RC_key = RC_return_key();
+    // Update mode
+    if ((RC_key == BUTTON_ZERO) & (last_RC_key != BUTTON_ZERO)) {
+        mode = ~mode;
+    }
+    
+    // Update pull_trigger
+    pull_trigger = (RC_key == BUTTON_OK);
+    
+    if (mode) {
+        // auto
+        MC_set_motion(MC_TOP_COMMAND_OUT);
+    } else {
+        // manual
+        MC_set_motion(((RC_key == BUTTON_ZERO) | RC_key == BUTTON_OK) ? BUTTON_STOP : RC_key);
     }
 }
 
-char RC_return_key() {
-    if (RC_data_ready) {
-        if (RC_data[0]) {
-            if (RC_data[1]) {
-                return BUTTON_RIGHT;
-            } else {
-                return BUTTON_DOWN;
+// A byte from the host, the IR capture FSM only takes requests while idle
+void capture_command(char command) {
+    if (capture_state != CAPTURE_IDLE) {
+        return;
+    }
+    if (command == RC_CAPTURE_COMMAND) {
+        RC_capture_count = 0;
+        RC_capturing = 1;
+        capture_state = CAPTURE_RECORDING;
+    } else {
+        // The host leads with a wake-up byte, stay up for its command
+        di();
+        CCPR2 = TMR1 + RC_Void_Threshold;
+        CCP2IF = 0;
+        RC_void_armed = 1;
+        ei();
+    }
+}
+
+// IR capture FSM, the host asks for one frame of raw edges at a time.
+// Polled on the 1ms tick, about the time 9600 baud takes per byte.
+void capture_service() {
+    switch (capture_state) {
+        case CAPTURE_IDLE:
+            if (OERR) {
+                CREN = 0;
+                CREN = 1;
             }
-        } else {
-            if (RC_data[1]) {
-                if (RC_data[2]) {
-                    return BUTTON_UP;
-                } else {
-                    return BUTTON_ZERO;
-                }
-            } else {
-                if (RC_data[2]) {
-                    return BUTTON_LEFT;
-                } else {
-                    return BUTTON_OK;
+            break;
+        case CAPTURE_RECORDING:
+            // Done when the buffer is full or the frame has gone quiet
+            if (RC_capturing == 0) {
+                RC_capture_sent = 0;
+                capture_state = CAPTURE_SENDING;
+            }
+            break;
+        case CAPTURE_SENDING:
+            if (TXIF) {
+                TXREG = RC_capture_byte(RC_capture_sent);
+                RC_capture_sent++;
+                if (RC_capture_sent == 3 + 2 * RC_capture_count) {
+                    capture_state = CAPTURE_IDLE;
                 }
             }
-        }
-    } else {
-        return BUTTON_STOP;
+            break;
     }
 }
 
@@ -301,11 +342,64 @@ void MC_set_motion(char motion) {
     }
 }
 
+// Capture stream: 'I', 'R', edge count, then low and high byte of each edge
+char RC_capture_byte(unsigned char index) {
+    unsigned char edge;
+    
+    if (index == 0) {
+        return 'I';
+    } else if (index == 1) {
+        return 'R';
+    } else if (index == 2) {
+        return RC_capture_count;
+    }
+    edge = (index - 3) >> 1;
+    if (index & 1) {
+        return RC_capture_lo[edge];
+    } else {
+        return RC_capture_hi[edge];
+    }
+}
+
 void interrupt interrupt_handler() {
+    unsigned int now;
+    unsigned int high;
+    
     if (RBIF) {
-        last_RC_time = TMR1;
+        // Reread TMR1 if TMR1L rolled over between the two byte reads. An
+        // overflow still pending below belongs to this stamp when TMR1 has
+        // just wrapped.
+        now = TMR1H << 8;
+        now |= TMR1L;
+        if (TMR1H != (now >> 8)) {
+            now = TMR1H << 8;
+            now |= TMR1L;
+        }
+        high = SYS_tick_high;
+        if (TMR1IF & (now < 0x8000)) {
+            high++;
+        }
+        last_RC_time = ((unsigned long) high << 16) | now;
         last_RC_data = RB2;
         RBIF = 0;
+        EV_rc_edge = 1;
+        // Restart the void timer
+        CCPR2 = now + RC_Void_Threshold;
+        CCP2IF = 0;
+        RC_void_armed = 1;
+        if (RC_capturing) {
+            RC_capture_lo[RC_capture_count] = ((unsigned char) now & 0xFE) | last_RC_data;
+            RC_capture_hi[RC_capture_count] = now >> 8;
+            RC_capture_count++;
+            if (RC_capture_count == RC_CAPTURE_SIZE) {
+                RC_capturing = 0;
+            }
+        }
+    }
+    
+    if (TMR1IF) {
+        SYS_tick_high++;
+        TMR1IF = 0;
     }
     
     if (CCP1IF) {
@@ -319,5 +413,23 @@ void interrupt interrupt_handler() {
             CCPR1 = CCPR1 + MC_HIGH_PULSE;
         }
         CCP1IF = 0;
+    }    
+    if (CCP2IF) {
+        // Unarmed, CCP2 still matches once a TMR1 wrap and is just cleared
+        if (RC_void_armed) {
+            EV_rc_void = 1;
+            RC_void_armed = 0;
+        }
+        CCP2IF = 0;
+    }
+    
+    if (TMR2IF) {
+        EV_ms = 1;
+        TMR2IF = 0;
     }
-}
\ No newline at end of file
+    
+    if (RCIF) {
+        UART_rx = RCREG; // Also clears RCIF
+        EV_uart = 1;
+    }
+}
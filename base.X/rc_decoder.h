@@ -0,0 +1,141 @@
+/*
+ * File:   rc_decoder.h
+ * Author: Zhou Zbou, Henry Teng
+ *
+ * IR remote decoder shared by the base firmware and the host replay tool in
+ * tools/. It defines its state, so include it from exactly one file, after
+ * defining last_RC_time, last_RC_data and RC_data_ready (the ISR's view of
+ * the latest RB2 edge and the frame-complete flag).
+ */
+
+#ifndef RC_DECODER_H
+#define RC_DECODER_H
+
+enum Buttons {BUTTON_STOP, BUTTON_UP, BUTTON_LEFT, BUTTON_RIGHT, BUTTON_DOWN, BUTTON_OK, BUTTON_ZERO};
+enum RC_States {RC_RESET, RC_START_FALL, RC_START_RISE, RC_RECV_FALL, RC_RECV_RISE, RC_CONT_FALL1, RC_CONT_RISE1, RC_CONT_FALL2, RC_CONT_RISE2};
+#define RC_Void_Threshold 27500 // 110ms * 1000us/ms * 1/4
+#define RC_Start_Low_Threshold 2150 // 8.6ms * 1000us/ms * 1/4, the oscillator start-up after a wake from sleep eats into the 9ms leader
+#define RC_Start_Idle_Threshold 1000 // 4ms * 1000us/ms * 1/4
+#define RC_Data_Low_Threshold 1// maybe not need, to be larger than measured
+#define RC_Data_Zero_Threshold 375 // 1.5ms * 1000us/ms * 1/4
+#define RC_Cont_Idle_Threshold 500 // 2ms * 1000us/ms * 1/4 to be smaller than measured
+#define RC_ACT_MARK 0x01 // Measure the next width from this edge
+#define RC_ACT_RESTART 0x02 // A new frame starts, back to bit 0
+#define RC_ACT_BIT 0x04 // Store a data bit, the guard gives its value
+#define RC_ACT_HOLD 0x08 // Ignore the edge unless the width exceeds RC_Cont_Idle_Threshold
+
+// RC FSM transition table, one row per RC_States entry, stored in program memory.
+// A row fires once last_RC_data reaches level; its guard is the width since the
+// last marked edge exceeding limit, and picks the pass or fail branch.
+typedef struct {
+    char level;
+    unsigned int limit;
+    char pass;
+    char pass_action;
+    char fail;
+    char fail_action;
+} RC_Transition;
+const RC_Transition RC_table[] = {
+    // level, limit,                       pass,           pass action,                  fail,           fail action
+    {0,       0,                           RC_START_FALL,  RC_ACT_MARK,                  RC_START_FALL,  RC_ACT_MARK},                // RC_RESET
+    {1,       RC_Start_Low_Threshold,      RC_START_RISE,  RC_ACT_MARK,                  RC_RESET,       0},                          // RC_START_FALL
+    {0,       RC_Start_Idle_Threshold,     RC_RECV_FALL,   RC_ACT_MARK,                  RC_RESET,       0},                          // RC_START_RISE
+    {1,       0,                           RC_RECV_RISE,   0,                            RC_RECV_RISE,   0},                          // RC_RECV_FALL
+    {0,       RC_Data_Zero_Threshold - 1,  RC_RECV_FALL,   RC_ACT_BIT | RC_ACT_MARK,     RC_RECV_FALL,   RC_ACT_BIT | RC_ACT_MARK},   // RC_RECV_RISE
+    {1,       RC_Start_Low_Threshold,      RC_CONT_RISE1,  RC_ACT_MARK,                  RC_CONT_RISE2,  0},                          // RC_CONT_FALL1
+    {0,       RC_Start_Idle_Threshold,     RC_RECV_FALL,   RC_ACT_MARK | RC_ACT_RESTART, RC_CONT_FALL2,  RC_ACT_MARK | RC_ACT_HOLD},  // RC_CONT_RISE1
+    {1,       0,                           RC_CONT_RISE2,  0,                            RC_CONT_RISE2,  0},                          // RC_CONT_FALL2
+    {0,       0,                           RC_CONT_FALL1,  RC_ACT_MARK,                  RC_CONT_FALL1,  RC_ACT_MARK}                 // RC_CONT_RISE2
+};
+
+// RC Module
+char RC_State = 0;
+char RC_index = 0;
+char RC_data[3];
+unsigned long last_critical_RC_time;
+
+// last_RC_time is written by the ISR a byte at a time, read it until two reads agree
+unsigned long RC_edge_time() {
+    unsigned long time;
+    
+    do {
+        time = last_RC_time;
+    } while (time != last_RC_time);
+    return time;
+}
+
+void RC_reset() {
+    RC_State = RC_RESET;
+    RC_index = 0;
+    RC_data_ready = 0;
+}
+
+void RC_step() {
+    const RC_Transition *rc;
+    unsigned long last_RC_time_backup;
+    unsigned long last_critical_difference;
+    char guard;
+    char action;
+    
+    rc = &RC_table[RC_State];
+    if (last_RC_data != rc->level) {
+        return;
+    }
+    last_RC_time_backup = RC_edge_time();
+    last_critical_difference = last_RC_time_backup - last_critical_RC_time;
+    guard = last_critical_difference > rc->limit;
+    action = guard ? rc->pass_action : rc->fail_action;
+    
+    if ((action & RC_ACT_HOLD) && (last_critical_difference <= RC_Cont_Idle_Threshold)) {
+        return;
+    }
+    if (action & RC_ACT_BIT) {
+        if (RC_index == 32) {
+            RC_State = RC_CONT_FALL1;
+            RC_data_ready = 1;
+            return;
+        }
+        if ((16 <= RC_index) & (RC_index <= 18)) { // We only need first 3 bits
+            RC_data[RC_index-16] = guard;
+        }
+        RC_index++;
+        RC_data_ready = 0;
+    }
+    if (action & RC_ACT_MARK) {
+        last_critical_RC_time = last_RC_time_backup;
+    }
+    if (action & RC_ACT_RESTART) {
+        RC_index = 0;
+    }
+    RC_State = guard ? rc->pass : rc->fail;
+}
+
+char RC_return_key() {
+    if (RC_data_ready) {
+        if (RC_data[0]) {
+            if (RC_data[1]) {
+                return BUTTON_RIGHT;
+            } else {
+                return BUTTON_DOWN;
+            }
+        } else {
+            if (RC_data[1]) {
+                if (RC_data[2]) {
+                    return BUTTON_UP;
+                } else {
+                    return BUTTON_ZERO;
+                }
+            } else {
+                if (RC_data[2]) {
+                    return BUTTON_LEFT;
+                } else {
+                    return BUTTON_OK;
+                }
+            }
+        }
+    } else {
+        return BUTTON_STOP;
+    }
+}
+
+#endif /* RC_DECODER_H */
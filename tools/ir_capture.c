@@ -0,0 +1,155 @@
+/*
+ * File:   ir_capture.c
+ *
+ * Host side of the base's IR capture mode. Asks the base for raw RB2 edges
+ * over its 9600 baud UART, one frame per request, and appends each frame to
+ * a capture file that ir_replay reads back:
+ *
+ *     "IRC1", edge count (u16 LE), then per edge: TMR1 time (u16 LE), level (u8)
+ *
+ * The base keeps the level in bit 0 of the time, so times have 8us resolution.
+ *
+ * Usage: ir_capture <serial device> <capture file> [frames]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define RC_CAPTURE_COMMAND 'C'
+#define RC_WAKE_BYTE 0x00 // One long low, ends in a single rising edge
+#define RC_WAKE_DELAY_US 20000 // The base stays up for 110ms after it
+
+static int serial_open(const char *path) {
+    struct termios tio;
+    int fd;
+
+    fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (tcgetattr(fd, &tio) < 0) {
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B9600);
+    cfsetospeed(&tio, B9600);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+        close(fd);
+        return -1;
+    }
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+static int serial_read(int fd, unsigned char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Returns the edge count, or -1 on a read error or a garbled header. */
+static int capture_frame(int fd, unsigned char *edges) {
+    unsigned char wake = RC_WAKE_BYTE;
+    unsigned char command = RC_CAPTURE_COMMAND;
+    unsigned char c;
+    unsigned char count;
+
+    // A sleeping base wakes on the start bit but doesn't receive that byte
+    if (write(fd, &wake, 1) != 1) {
+        return -1;
+    }
+    tcdrain(fd);
+    usleep(RC_WAKE_DELAY_US);
+    if (write(fd, &command, 1) != 1) {
+        return -1;
+    }
+    // Resynchronise on the 'I', 'R' header
+    do {
+        if (serial_read(fd, &c, 1) < 0) {
+            return -1;
+        }
+        while (c == 'I') {
+            if (serial_read(fd, &c, 1) < 0) {
+                return -1;
+            }
+            if (c == 'R') {
+                if (serial_read(fd, &count, 1) < 0) {
+                    return -1;
+                }
+                if (serial_read(fd, edges, 2 * count) < 0) {
+                    return -1;
+                }
+                return count;
+            }
+        }
+    } while (1);
+}
+
+int main(int argc, char **argv) {
+    unsigned char edges[2 * 255];
+    unsigned char record[3];
+    FILE *out;
+    int frames = 1;
+    int fd;
+    int count;
+    int i;
+    int n;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <serial device> <capture file> [frames]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 3) {
+        frames = atoi(argv[3]);
+    }
+    fd = serial_open(argv[1]);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    out = fopen(argv[2], "ab");
+    if (out == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    for (n = 0; n < frames; n++) {
+        fprintf(stderr, "frame %d: press a remote button\n", n + 1);
+        count = capture_frame(fd, edges);
+        if (count < 0) {
+            fprintf(stderr, "%s: read failed\n", argv[1]);
+            return 1;
+        }
+        fputs("IRC1", out);
+        fputc(count & 0xFF, out);
+        fputc(count >> 8, out);
+        for (i = 0; i < count; i++) {
+            // The base sends the low byte first, with the level in bit 0
+            record[0] = edges[2 * i] & 0xFE;
+            record[1] = edges[2 * i + 1];
+            record[2] = edges[2 * i] & 1;
+            fwrite(record, 1, sizeof(record), out);
+        }
+        fflush(out);
+        fprintf(stderr, "frame %d: %d edges\n", n + 1, count);
+    }
+
+    fclose(out);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * File:   ir_replay.c
+ *
+ * Replays capture files written by ir_capture through the base's RC decoder
+ * (base.X/rc_decoder.h) and prints the key each frame decodes to. Given an
+ * expected key, exits non-zero if any frame decodes to something else, so a
+ * directory of captures works as a regression corpus for the RC thresholds.
+ *
+ * Usage: ir_replay <capture file> [STOP|UP|LEFT|RIGHT|DOWN|OK|ZERO]
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+// The decoder's view of the ISR. Times are unwrapped to 32 bits here, as the
+// base's system tick does, so the widths the decoder takes never wrap.
+unsigned long last_RC_time;
+char last_RC_data;
+char RC_data_ready;
+
+#include "../base.X/rc_decoder.h"
+
+static const char *key_names[] = {"STOP", "UP", "LEFT", "RIGHT", "DOWN", "OK", "ZERO"};
+
+static int read_u16(FILE *in, unsigned int *value) {
+    int lo = fgetc(in);
+    int hi = fgetc(in);
+
+    if (lo == EOF || hi == EOF) {
+        return -1;
+    }
+    *value = lo | (hi << 8);
+    return 0;
+}
+
+// Feed one edge the way the base main loop sees it: the void check first,
+// then the FSM until it stops moving on this edge.
+static void replay_edge(unsigned int time, char level) {
+    char state;
+
+    if (time - last_RC_time > RC_Void_Threshold) {
+        RC_reset();
+    }
+    last_RC_time = time;
+    last_RC_data = level;
+    do {
+        state = RC_State;
+        RC_step();
+    } while (RC_State != state);
+}
+
+int main(int argc, char **argv) {
+    char magic[4];
+    unsigned int count;
+    unsigned int raw;
+    unsigned int last_raw;
+    unsigned int time;
+    int expected = -1;
+    int failures = 0;
+    int frame = 0;
+    int level;
+    int key;
+    unsigned int i;
+    FILE *in;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <capture file> [STOP|UP|LEFT|RIGHT|DOWN|OK|ZERO]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 2) {
+        for (i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+            if (strcmp(argv[2], key_names[i]) == 0) {
+                expected = i;
+            }
+        }
+        if (expected < 0) {
+            fprintf(stderr, "%s: unknown key %s\n", argv[0], argv[2]);
+            return 2;
+        }
+    }
+    in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        perror(argv[1]);
+        return 2;
+    }
+
+    while (fread(magic, 1, sizeof(magic), in) == sizeof(magic)) {
+        if (memcmp(magic, "IRC1", sizeof(magic)) != 0 || read_u16(in, &count) < 0) {
+            fprintf(stderr, "%s: bad frame header\n", argv[1]);
+            return 2;
+        }
+        frame++;
+        RC_reset();
+        key = BUTTON_STOP;
+        time = 0;
+        last_raw = 0;
+        last_RC_time = 0;
+        for (i = 0; i < count; i++) {
+            level = 0;
+            if (read_u16(in, &raw) < 0 || (level = fgetc(in)) == EOF) {
+                fprintf(stderr, "%s: truncated frame %d\n", argv[1], frame);
+                return 2;
+            }
+            if (i == 0) {
+                // Start far enough in that the first edge is seen after a void
+                time = RC_Void_Threshold + 1;
+            } else {
+                time += (raw - last_raw) & 0xFFFF;
+            }
+            last_raw = raw;
+            replay_edge(time, level);
+            if (RC_return_key() != BUTTON_STOP) {
+                key = RC_return_key();
+            }
+        }
+        printf("frame %d: %u edges, %s\n", frame, count, key_names[key]);
+        if (expected >= 0 && key != expected) {
+            failures++;
+        }
+    }
+
+    fclose(in);
+    if (failures) {
+        fprintf(stderr, "%d of %d frames did not decode to %s\n", failures, frame, key_names[expected]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#
+#  isr_report.awk - instruction counts per interrupt_handler() branch
+#
+#  Reads an XC8 assembly listing (.lst) and attributes every instruction of
+#  the interrupt function to the top level "if (...)" branch its C source
+#  line belongs to. Bank selects (bcf/bsf on STATUS RP0/RP1) are counted
+#  separately since they are pure overhead.
+#
+#  Usage: awk -f isr_report.awk dist/default/production/top.X.production.lst
+#
+
+BEGIN {
+    in_isr = 0
+    depth = 0
+    branch = "prologue"
+    nbranches = 0
+}
+
+function use(name) {
+    if (!(name in count)) {
+        order[nbranches++] = name
+        count[name] = 0
+        banksel[name] = 0
+    }
+    branch = name
+}
+
+# C source line echoed into the listing, e.g. ";top_main.c: 420: void interrupt ..."
+/;[^ ]+\.c: [0-9]+: / {
+    src = $0
+    sub(/.*;[^ ]+\.c: [0-9]+: /, "", src)
+    if (!in_isr) {
+        if (src ~ /void interrupt/) {
+            in_isr = 1
+            use("prologue")
+        } else {
+            next
+        }
+    }
+    if (depth == 1 && match(src, /^if \([A-Za-z0-9_ &]+\)/)) {
+        use(substr(src, 5, RLENGTH - 5))
+    }
+    opens = gsub(/\{/, "{", src)
+    closes = gsub(/\}/, "}", src)
+    depth += opens - closes
+    if (depth == 0 && closes > 0) {
+        use("epilogue")
+    }
+    next
+}
+
+# Instruction line: listing line, address, opcode, mnemonic
+in_isr && $2 ~ /^[0-9A-Fa-f]+$/ && $3 ~ /^[0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f]$/ && $4 ~ /^[a-z]+$/ {
+    count[branch]++
+    if (($4 == "bcf" || $4 == "bsf") && ($5 ~ /^3,[56]/)) {
+        banksel[branch]++
+    }
+    if ($4 == "retfie") {
+        in_isr = 0
+    }
+}
+
+END {
+    if (nbranches == 0) {
+        print "isr_report: no interrupt function found" > "/dev/stderr"
+        exit 1
+    }
+    printf "%-16s %8s %8s\n", "branch", "instr", "banksel"
+    for (i = 0; i < nbranches; i++) {
+        name = order[i]
+        printf "%-16s %8d %8d\n", name, count[name], banksel[name]
+        total += count[name]
+        total_banksel += banksel[name]
+    }
+    printf "%-16s %8d %8d\n", "total", total, total_banksel
+}
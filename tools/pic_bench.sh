@@ -0,0 +1,202 @@
+#!/bin/sh
+#
+#  pic_bench.sh - instruction cycle benchmark of a firmware image in gpsim
+#
+#  Usage: pic_bench.sh <processor> <hex> <listing> <stimulus> <budgets>
+#
+#  Every line of <budgets> is "name|from|to|budget" and measures the cycles
+#  from an execution of <from> to the next execution of <to>:
+#
+#     from/to    _symbol        a label in the listing, e.g. _RC_step
+#                line:text      first instruction of the C line starting with text
+#                first:...      (from only) pair a to with the first from since
+#                               the last to, not the most recent, for latencies
+#                               from an event that can be posted again
+#                retfie         (to only) the next retfie after from
+#                return         (to only) the next return after from
+#                period         (to only) from one execution of from to the next
+#
+#  The image runs in gpsim with <stimulus> (gpsim stimulus/attach commands)
+#  attached until BENCH_SAMPLES spans are paired, or BENCH_MAX_RUNS breaks
+#  have been taken. The worst span is checked against budget, and the script
+#  exits non-zero when any probe is over or has no samples.
+#
+
+SAMPLES=${BENCH_SAMPLES:-50}
+MAX_RUNS=${BENCH_MAX_RUNS:-200000}
+
+if [ $# -ne 5 ]; then
+    echo "usage: $0 <processor> <hex> <listing> <stimulus> <budgets>" >&2
+    exit 2
+fi
+PROCESSOR=$1
+HEX=$2
+LISTING=$3
+STIMULUS=$4
+BUDGETS=$5
+
+command -v gpsim > /dev/null || { echo "$0: gpsim not found" >&2; exit 2; }
+for f in "$HEX" "$LISTING" "$STIMULUS" "$BUDGETS"; do
+    [ -r "$f" ] || { echo "$0: cannot read $f, run 'make build' first" >&2; exit 2; }
+done
+
+# Program address of a probe end point, from the XC8 listing
+resolve() {
+    awk -v want="$1" -v after="$2" '
+        function hex(s,   i, n) {
+            n = 0
+            for (i = 1; i <= length(s); i++) {
+                n = n * 16 + index("0123456789abcdef", tolower(substr(s, i, 1))) - 1
+            }
+            return n
+        }
+        /;[^ ]+\.c: [0-9]+: / {
+            src = $0
+            sub(/.*;[^ ]+\.c: [0-9]+: /, "", src)
+            if (want ~ /^line:/ && index(src, substr(want, 6)) == 1) {
+                armed = 1
+            }
+            next
+        }
+        $2 ~ /^[0-9A-Fa-f]+$/ && $3 ~ /^_?[A-Za-z0-9_]+:$/ {
+            if ($3 == want ":") {
+                armed = 1
+            }
+            next
+        }
+        $2 ~ /^[0-9A-Fa-f]+$/ && $3 ~ /^[0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f]$/ && $4 ~ /^[a-z]+$/ {
+            if (after != "" && hex($2) <= hex(after)) {
+                next
+            }
+            if (armed || $4 == want) {
+                print $2
+                exit
+            }
+        }
+    ' "$LISTING"
+}
+
+TMP=${TMPDIR:-/tmp}/pic_bench.$$
+trap 'rm -f "$TMP".*' EXIT
+printf "%-14s %8s %8s %8s\n" "probe" "worst" "mean" "budget"
+grep -v '^[[:space:]]*#' "$BUDGETS" | grep -v '^[[:space:]]*$' | while IFS='|' read -r name from to budget; do
+    first=0
+    case $from in
+        first:*)
+            from=${from#first:}
+            first=1
+            ;;
+    esac
+    start=$(resolve "$from" "")
+    if [ -z "$start" ]; then
+        echo "$name: cannot find $from in $LISTING" >&2
+        echo fail > "$TMP.failed"
+        continue
+    fi
+    case $to in
+        period) stop=$start ;;
+        retfie|return) stop=$(resolve "$to" "$start") ;;
+        *) stop=$(resolve "$to" "") ;;
+    esac
+    if [ -z "$stop" ]; then
+        echo "$name: cannot find $to in $LISTING" >&2
+        echo fail > "$TMP.failed"
+        continue
+    fi
+
+    # Every break costs a run, including stops with nothing to pair, so the
+    # runs needed can't be known up front. The simulation is deterministic:
+    # rerun it with more runs until enough spans are paired.
+    runs=$((SAMPLES * 2 + 1))
+    while :; do
+        {
+            echo "processor $PROCESSOR"
+            echo "load h $HEX"
+            cat "$STIMULUS"
+            echo "break e 0x$start"
+            [ "$stop" != "$start" ] && echo "break e 0x$stop"
+            awk -v runs=$runs 'BEGIN { for (i = 0; i < runs; i++) print "run\ncycles\npc" }'
+            echo "quit"
+        } > "$TMP.stc"
+
+        # One "cycles pc" line per break, the pc says which breakpoint was hit
+        gpsim -i -c "$TMP.stc" < /dev/null 2>&1 | awk '
+            /cycles[^=]*=/ {
+                c = $0
+                sub(/.*cycles[^=]*= */, "", c)
+                sub(/[^0-9A-Fa-fx].*/, "", c)
+                next
+            }
+            /(^|[^A-Za-z_])pc[^=]*=/ && c != "" {
+                pc = $0
+                sub(/.*pc[^=]*= */, "", pc)
+                sub(/[^0-9A-Fa-fx].*/, "", pc)
+                print c, pc
+                c = ""
+            }
+        ' > "$TMP.cycles"
+
+        # A span is a stop and the most recent start before it, or the first
+        # one since the last stop for first: probes. Stops with no start (the
+        # probe was entered before the image got to from) are dropped. A
+        # period is every gap between hits.
+        awk -v start="0x$start" -v stop="0x$stop" -v first=$first -v period=$([ "$stop" = "$start" ] && echo 1 || echo 0) '
+            function num(s,   i, n) {
+                if (s !~ /^0x/) {
+                    return s + 0
+                }
+                n = 0
+                for (i = 3; i <= length(s); i++) {
+                    n = n * 16 + index("0123456789abcdef", tolower(substr(s, i, 1))) - 1
+                }
+                return n
+            }
+            {
+                c = num($1)
+                pc = num($2)
+                if (period) {
+                    if (NR > 1) {
+                        print c - last
+                    }
+                    last = c
+                } else if (pc == num(start)) {
+                    if (!(first && armed)) {
+                        last = c
+                    }
+                    armed = 1
+                } else if (pc == num(stop) && armed) {
+                    print c - last
+                    armed = 0
+                }
+            }
+        ' "$TMP.cycles" > "$TMP.spans"
+
+        [ $(wc -l < "$TMP.spans") -ge $SAMPLES ] && break
+        [ $(wc -l < "$TMP.cycles") -lt $runs ] && break # gpsim stopped early
+        [ $runs -ge $MAX_RUNS ] && break
+        runs=$((runs * 4))
+        [ $runs -gt $MAX_RUNS ] && runs=$MAX_RUNS
+    done
+
+    head -n $SAMPLES "$TMP.spans" | awk -v name="$name" -v budget="$budget" '
+        {
+            n++
+            sum += $1
+            if ($1 > worst) {
+                worst = $1
+            }
+        }
+        END {
+            if (n == 0) {
+                printf "%-14s no samples\n", name
+                exit 1
+            }
+            over = (worst > budget)
+            printf "%-14s %8d %8d %8d%s\n", name, worst, sum / n, budget, (over ? "  OVER BUDGET" : "")
+            exit over
+        }
+    ' || echo fail > "$TMP.failed"
+done
+
+[ -e "$TMP.failed" ] && exit 1
+exit 0
@@ -0,0 +1,244 @@
+/*
+ * File:   wd_check.c
+ *
+ * Host check of the top's echo timing and range filter (top.X/wd_echo.h).
+ *
+ * Echo timing runs the sensors' echo edges through a cycle by cycle model of
+ * the top ISR and WD_fire(): CCP1 fires every 500us and every pass is taken
+ * to run the whole isr budget, so edges wait behind it. The widths the ISR
+ * stamps must stay within WD_EDGE_ERROR of the real ones, with each edge
+ * attributed to its own sensor, also when edges of several sensors fall in
+ * one pass or into the window WD_fire() runs with RBIE off.
+ *
+ * The range filter is fed a spurious first echo, and approaches at 1m/s with
+ * ping cycles of 7ms and 30ms, whose closing speed must come out the same.
+ *
+ * Usage: wd_check
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// The ISR's view of the echo pins, as top_main.c defines it
+unsigned int WD_rise_time[3];
+unsigned int WD_fall_time[3];
+char WD_echo_done;
+char WD_last_pins;
+
+#define SYS_TICKS_PER_MS 250
+#define SYS_MS(ms) ((unsigned long) (ms) * SYS_TICKS_PER_MS)
+
+#include "../top.X/wd_echo.h"
+
+// Times below are instruction cycles, 2 per us at 8MHz, 8 per Timer1 tick
+#define CYCLES_PER_TICK 8
+#define ISR_ENTRY 20 // Context save before the TMR1 read
+#define ISR_PASS 250 // The isr budget in top.X/bench/budgets
+#define CCP1_PERIOD (125 * CYCLES_PER_TICK) // PWM_INCREMENT
+#define FIRE_WINDOW 60 // WD_fire() with RBIE off: the 10us pulse and the TMR1 read
+#define WD_EDGE_ERROR 42 // Ticks, the bound stated in the top ISR
+
+struct echo {
+    long fire; // WD_fire() starts
+    long rise;
+    long fall;
+};
+
+static int failures;
+static int worst_error;
+
+static unsigned int stamp(long t) {
+    return (unsigned int) (t / CYCLES_PER_TICK) & 0xFFFF;
+}
+
+// One ping cycle of all three sensors, returns 0 if any width is off
+static int run_cycle(const struct echo *echo, long ccp1_phase) {
+    long end;
+    long t;
+    long busy_until = 0;
+    long sample_at = -1;
+    long fire_left = 0;
+    char fired = 0;
+    char levels = 0;
+    char last_read = 0;
+    char mask = 0;
+    char rbif = 0;
+    char rbie = 1;
+    char ccp1 = 0;
+    char pins;
+    int firing = -1;
+    int sensor;
+    int width;
+    int error;
+    int ok = 1;
+
+    WD_echo_done = 0;
+    WD_last_pins = 0;
+    end = 0;
+    for (sensor = 0; sensor < 3; sensor++) {
+        if (echo[sensor].fall > end) {
+            end = echo[sensor].fall;
+        }
+    }
+    end += 2 * (ISR_ENTRY + ISR_PASS + CCP1_PERIOD);
+
+    for (t = 0; t < end; t++) {
+        for (sensor = 0; sensor < 3; sensor++) {
+            if (t == echo[sensor].rise) {
+                levels |= 1 << sensor;
+            } else if (t == echo[sensor].fall) {
+                levels &= ~(1 << sensor);
+            }
+        }
+        if ((t + ccp1_phase) % CCP1_PERIOD == 0) {
+            ccp1 = 1;
+        }
+        if ((levels & mask) != last_read) {
+            rbif = 1;
+        }
+
+        // The ISR samples PORTB and TMR1 on entry, and tests RBIF, not RBIE
+        if (t == sample_at) {
+            if (rbif) {
+                pins = levels & mask;
+                last_read = pins;
+                rbif = 0;
+                WD_echo_edges(pins, stamp(t));
+            }
+            sample_at = -1;
+        }
+        if ((t >= busy_until) && (sample_at < 0) && (ccp1 | (rbif & rbie))) {
+            sample_at = t + ISR_ENTRY;
+            busy_until = sample_at + ISR_PASS;
+            ccp1 = 0;
+        }
+        if ((t < busy_until) || (sample_at >= 0)) {
+            continue;
+        }
+
+        // Main runs WD_fire() whenever the ISR is idle
+        if (firing < 0) {
+            for (sensor = 0; sensor < 3; sensor++) {
+                if (((fired & (1 << sensor)) == 0) && (t >= echo[sensor].fire)) {
+                    firing = sensor;
+                    fire_left = FIRE_WINDOW;
+                    rbie = 0;
+                    break;
+                }
+            }
+        } else if (--fire_left == 0) {
+            WD_rise_time[firing] = stamp(t);
+            mask |= 1 << firing;
+            pins = levels & mask;
+            last_read = pins;
+            rbif = 0;
+            WD_echo_edges(pins & ~(1 << firing), stamp(t));
+            WD_last_pins = pins;
+            fired |= 1 << firing;
+            firing = -1;
+            rbie = 1;
+        }
+    }
+
+    for (sensor = 0; sensor < 3; sensor++) {
+        if ((WD_echo_done & (1 << sensor)) == 0) {
+            ok = 0;
+            continue;
+        }
+        width = (WD_fall_time[sensor] - WD_rise_time[sensor]) & 0xFFFF;
+        error = width - (int) ((echo[sensor].fall - echo[sensor].rise) / CYCLES_PER_TICK);
+        if (abs(error) > worst_error) {
+            worst_error = abs(error);
+        }
+        if (abs(error) > WD_EDGE_ERROR) {
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+// Sweep the edges across the CCP1 passes and WD_fire() windows
+static void check_echo_timing(void) {
+    struct echo echo[3];
+    long phase;
+    long delta;
+    int scenarios = 0;
+    int failed = 0;
+    int i;
+
+    for (phase = 0; phase < CCP1_PERIOD; phase += 37) {
+        // The left echo ends across the centre's trigger window
+        for (delta = -300; delta <= 300; delta += 7) {
+            echo[0] = (struct echo) {0, 1000, 6000 + delta};
+            echo[1] = (struct echo) {6000, 7000, 10000};
+            echo[2] = (struct echo) {12000, 13000, 15000};
+            scenarios++;
+            failed += !run_cycle(echo, phase);
+        }
+        // The centre and right echoes end in the same ISR pass
+        for (delta = -300; delta <= 300; delta += 7) {
+            echo[0] = (struct echo) {0, 1000, 3000};
+            echo[1] = (struct echo) {6000, 7000, 15000 + delta};
+            echo[2] = (struct echo) {12000, 13000, 15000};
+            scenarios++;
+            failed += !run_cycle(echo, phase);
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        WD_rise_time[i] = 0;
+        WD_fall_time[i] = 0;
+    }
+    printf("echo timing: %d cycles, worst width error %d ticks (bound %d)\n", scenarios, worst_error, WD_EDGE_ERROR);
+    if (failed) {
+        printf("echo timing: %d cycles misattributed or over the bound\n", failed);
+        failures++;
+    }
+}
+
+// Feed a target closing at 1m/s (145 ticks per 100ms), returns WD_closing
+static int approach(int sensor, unsigned long cycle_ms, int *evade_range) {
+    unsigned long now = SYS_MS(1000);
+    long range = 3000;
+    int closing = 0;
+
+    *evade_range = 0;
+    while (range > 0) {
+        if (WD_update(sensor, range, now) && (*evade_range == 0)) {
+            *evade_range = WD_range[sensor];
+            closing = WD_closing[sensor];
+        }
+        now += SYS_MS(cycle_ms);
+        range -= 1450L * cycle_ms / 1000;
+    }
+    return closing;
+}
+
+static void check_range_filter(void) {
+    int fast;
+    int slow;
+    int fast_range;
+    int slow_range;
+
+    if (WD_update(WD_SENSOR_LEFT, 100, SYS_MS(10))) {
+        printf("range filter: a spurious first echo evades\n");
+        failures++;
+    }
+    fast = approach(WD_SENSOR_CENTER, 7, &fast_range);
+    slow = approach(WD_SENSOR_RIGHT, 30, &slow_range);
+    printf("range filter: closing %d and %d ticks per %dms at 7ms and 30ms cycles (145 expected), evading at %d and %d ticks\n",
+           fast, slow, WD_CLOSING_MS, fast_range, slow_range);
+    if ((abs(fast - 145) > 15) || (abs(slow - 145) > 15)) {
+        printf("range filter: closing speed depends on the ping cycle\n");
+        failures++;
+    }
+    if ((fast_range <= WD_Collision_Threshold) || (slow_range <= WD_Collision_Threshold)) {
+        printf("range filter: no evade before the collision threshold\n");
+        failures++;
+    }
+}
+
+int main(void) {
+    check_echo_timing();
+    check_range_filter();
+    return failures ? 1 : 0;
+}
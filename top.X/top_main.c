@@ -32,7 +32,7 @@
 #define TDP_LEFT RA0
 #define TDP_CENTER RA1
 #define TDP_RIGHT RA2
-#define TDP_ONE_MIN 4135000   // 1min * 60s/min * 1000ms/s * 1000us/ms * 2/us / 30 = 4000000
+#define TDP_WARMUP_MS 60000 // Let the sensors settle for a minute
 enum TDP_States {LEFT90, RIGHT90, LEFT180, RIGHT180, TDP_Standby, TDP_Engaged, TDP_Evade_Left1, TDP_Evade_Left2, TDP_Evade_Center1, TDP_Evade_Center2, TDP_Evade_Right1, TDP_Evade_Right2};
 
 // WD Module
@@ -40,19 +40,70 @@ enum TDP_States {LEFT90, RIGHT90, LEFT180, RIGHT180, TDP_Standby, TDP_Engaged, T
 #define WD_CENTER RB1
 #define WD_RIGHT RB2
 #define WD_Trigger_Width 10
-#define WD_Collision_Threshold 174 // 30cm * 58us/cm
-#define WD_10us 246
-enum WD_States {Left_Out, Left_In, Center_Out, Center_In, Right_Out, Right_In};
+// Interleaved pinging: each sensor fires at its offset into the cycle, and a new
+// cycle starts once every echo is back or WD_Cycle_Timeout has passed.
+#define WD_Offset_Left 0
+#define WD_Offset_Center 750 // 3ms
+#define WD_Offset_Right 1500 // 6ms
+#define WD_Cycle_Timeout 7500 // 30ms, last offset plus the longest (18.5ms) echo
+#define WD_Crosstalk_Window 50 // 200us, echoes ending this close heard the same burst
 
 // MC Module
 #define MC_OUT PORTD
-#define FORTYFIVE_DEG_COUNT 4
-#define NINTY_DEG_COUNT 8
-#define ONEEIGHTY_DEG_COUNT 16
-#define ENGAGED_DELAY 2
+#define MC_DEFAULT_TURN_MS 9000 // Full turn, used until calibrated
+#define EVADE_FORWARD_MS 1250
+#define ENGAGED_DELAY_MS 750
 enum Motions {CMD_STOP, CMD_FORWARD, CMD_LEFT, CMD_RIGHT};
 enum MC_States {Stop, Go_Forward, Turn_Left, Turn_Right};
 
+// Motion Queue
+// Primitives (motion, duration) run back to back from the CCP2 interrupt, which
+// is the only writer of MC_OUT while the queue is in use.
+#define MQ_SIZE 4 // Power of two, the ring indices run free and are masked
+#define MQ_HOLD 0 // Duration of a primitive that runs until flushed
+#define MQ_NO_TAG 0xFF
+// Pushing above the running priority preempts it. Tracking outranks evasion as
+// before, the target is itself an obstacle to the ultrasonic sensors.
+enum MQ_Priorities {MQ_PRIO_SEARCH, MQ_PRIO_EVADE, MQ_PRIO_TRACK, MQ_PRIO_CALIBRATE};
+
+// TDP FSM transition table, one row per TDP_States entry, stored in program memory.
+// A state lasts amount (ms, or degrees for turns), then moves on to next.
+typedef struct {
+    char motion;
+    unsigned int amount;
+    char next;
+} TDP_Transition;
+const TDP_Transition TDP_table[] = {
+    // motion,   amount,            next
+    {Turn_Left,  90,                RIGHT180},          // LEFT90
+    {Turn_Right, 90,                LEFT180},           // RIGHT90
+    {Turn_Left,  180,               RIGHT180},          // LEFT180
+    {Turn_Right, 180,               LEFT180},           // RIGHT180
+    {Stop,       0,                 TDP_Standby},       // TDP_Standby
+    {Go_Forward, ENGAGED_DELAY_MS,  TDP_Standby},       // TDP_Engaged
+    {Turn_Right, 45,                TDP_Evade_Left2},   // TDP_Evade_Left1
+    {Go_Forward, EVADE_FORWARD_MS,  TDP_Standby},       // TDP_Evade_Left2
+    {Turn_Left,  90,                TDP_Evade_Center2}, // TDP_Evade_Center1
+    {Go_Forward, EVADE_FORWARD_MS,  TDP_Standby},       // TDP_Evade_Center2
+    {Turn_Left,  45,                TDP_Evade_Right2},  // TDP_Evade_Right1
+    {Go_Forward, EVADE_FORWARD_MS,  TDP_Standby}        // TDP_Evade_Right2
+};
+
+// Turn Calibration
+// A full turn each way is timed against whatever sits in front of the centre
+// sensor, between two successive moments it drops out of view.
+#define CAL_EE_MAGIC 0x5A // Written last, marks the turn times as valid
+#define CAL_EE_BASE 0x00 // Magic, then the left and right full turn ms, low byte first
+#define CAL_MIN_TURN_MS 2000
+#define CAL_MAX_TURN_MS 20000
+#define CAL_TIMEOUT_MS 25000 // Per direction, two turns plus the approach
+#define CAL_SETTLE_MS 500 // Let the robot coast to a stop and the median refill
+#define CAL_SAMPLE_MS 100 // A centre echo must come back within this
+#define CAL_Reference_Max 1450 // 100cm * 58us/cm / 4us, the reference must be this close
+#define CAL_Tolerance 44 // 3cm, how far the range may stray while the reference is in view
+#define CAL_HOLD_MS 100 // In view at least this long to count, a passing echo won't do
+#define CAL_MATCH_PERCENT 25 // How far the left and right turn times may differ
+
 // Mode
 #define mode RC0
 
@@ -62,9 +113,8 @@ enum MC_States {Stop, Go_Forward, Turn_Left, Turn_Right};
 #define Trigger_Servo2 RC3
 #define PWM_PERIOD 5000
 #define PWM_INCREMENT 125
-#define TWOFIFTY_MS 62500
-#define TRIG_DELAY_MULTIPLIER 5
-#define TRIG_COOLDOWN_MULTIPLIER 10
+#define TRIG_DELAY_MS 1500
+#define TRIG_COOLDOWN_MS 2750
 enum Pulse_Widths {MIN_HIGH = 1, MAX_HIGH = 5, TOTAL_WIDTH = 40};
 enum Trigger_States {Trigger_StandBy, Trigger_Pulled, Trigger_CoolDown};
 
@@ -74,45 +124,131 @@ enum Trigger_States {Trigger_StandBy, Trigger_Pulled, Trigger_CoolDown};
 #define B RC6
 enum System_States {SYSTEM_INIT, SYSTEM_MANUAL, SYSTEM_SEARCHING, SYSTEM_ENGAGED};
 
+// System Tick
+// Timer1 extended to 32 bits by counting its overflows, wraps after 4.7 hours
+#define SYS_TICKS_PER_MS 250 // 4us per Timer1 tick
+#define SYS_MS(ms) ((unsigned long) (ms) * SYS_TICKS_PER_MS)
+
+// Events
+// Posted by the ISR, each handled and cleared by main()
+#define EV_MS_PR2 124 // 8MHz / 4 / 16 / (124 + 1) = 1kHz Timer2 tick
+
 // Function Prototypes
-void TDP_evade_left(void);
-void TDP_evade_center(void);
-void TDP_evade_right(void);
+unsigned long SYS_now(void);
+unsigned long SYS_elapsed(unsigned long);
+char SYS_expired(unsigned long);
+char MQ_push(char, unsigned int, char, char);
+char MQ_pending(void);
+void MQ_flush(void);
+void MQ_stop(void);
+void MQ_kick(void);
+unsigned int TDP_duration(char);
+void TDP_service(void);
+void TDP_plan(void);
+void TDP_evade(char);
+char CAL_load(void);
+void CAL_store(void);
+void CAL_run(void);
+void CAL_hold(char);
+char CAL_sample(unsigned long);
+char CAL_near(unsigned int);
+unsigned int CAL_measure(char, unsigned int);
+void WD_service(void);
+void WD_fire(char);
 void interrupt interrupt_handler(void);
 
 // Global Variables
+// ISR Hot State
+// Everything the ISR touches lives either in common RAM (0x74-0x7B, visible from
+// every bank) or in bank 0 next to the SFRs it works with, so the ISR body needs
+// no bank selects for its own variables. 0x70-0x73 and 0x7C-0x7F are left to the
+// compiler for its temporaries and the interrupt context save.
+// Absolute objects are not cleared by the runtime startup, see main().
+typedef union {
+    struct {
+        unsigned under_auto : 1;
+        unsigned direction : 1;
+        unsigned mq_active : 1;
+        unsigned mq_armed : 1;
+        unsigned ev_ms : 1;
+        unsigned ev_echo : 1;
+        unsigned ev_motion : 1;
+    };
+    char all;
+} ISR_Flags;
+ISR_Flags ISR_flags @ 0x74;
+#define trigger_under_auto ISR_flags.under_auto
+#define last_direction ISR_flags.direction // 0 is left, 1 is right
+#define MQ_active ISR_flags.mq_active // A primitive is running, cleared by the ISR when the queue runs dry
+#define MQ_armed ISR_flags.mq_armed // The ISR runs the executor on CCP2, spares it a bank 1 read of CCP2IE
+#define EV_ms ISR_flags.ev_ms // Timer2, every 1ms
+#define EV_echo ISR_flags.ev_echo // An ultrasonic echo ended
+#define EV_motion ISR_flags.ev_motion // The motion queue started a primitive or ran dry
+
 // TDP Module
 #define nTDP_Delay_Override RC7
-char TDP_counter = 0;
-char TDP_state = TDP_Standby;
-char TDP_saved_state;
-char TDP_evade_counter = 0;
-bit last_direction = 0; // 0 is left, 1 is right
+char TDP_state = TDP_Standby; // State of the last primitive TDP queued
+char TDP_saved_state = TDP_Standby;
+unsigned int TDP_saved_remaining; // ms the saved state had left when the evade began
 
 // WD Module
-bit WD_last_left;
-bit WD_last_center;
-bit WD_last_right;
-unsigned int last_RE_time;
-unsigned int last_FE_time;
-char WD_state;
-bit WD_feedback_received = 0;
-bit WD_probe_sent = 0;
-bit WD_probe_finished = 0;
+unsigned int WD_rise_time[3] @ 0x23;
+unsigned int WD_fall_time[3] @ 0x29;
+char WD_echo_done @ 0x2F; // One bit per sensor, set by the ISR on the falling edge of its echo
+char WD_probe_mask @ 0x76; // Pins listening for an echo, spares the ISR a bank 1 read of IOCB
+char WD_last_pins @ 0x7B; // Their levels as of the last RBIF
+#include "wd_echo.h" // Needs the four above and SYS_MS()
+char WD_fired; // One bit per sensor pinged this cycle
+char WD_updated; // One bit per sensor with a new WD_range, cleared by its reader
+unsigned long WD_cycle_start;
+const unsigned int WD_offset[3] = {WD_Offset_Left, WD_Offset_Center, WD_Offset_Right};
+const char WD_priority[3] = {WD_SENSOR_CENTER, WD_SENSOR_LEFT, WD_SENSOR_RIGHT}; // Centre wins when several see a collision
+const char WD_evade_state[3] = {TDP_Evade_Left1, TDP_Evade_Center1, TDP_Evade_Right1};
 
 // RGB Module
 char system_state;
 
 // Trigger
-unsigned int high_pulse = MIN_HIGH;
+char high_pulse @ 0x77;
 char trigger_state = Trigger_StandBy;
-char trigger_counter = 0;
-char PWM_counter = 0;
-bit trigger_under_auto = 0;
+unsigned long trigger_deadline;
+char PWM_counter @ 0x7A;
+
+// System Tick
+unsigned int SYS_tick_high @ 0x78; // Timer1 overflows, the upper half of the tick
+
+// Motion Queue
+// The ISR advances MQ_head, main() advances MQ_tail
+unsigned long MQ_ticks[MQ_SIZE] @ 0x30;
+unsigned long MQ_end @ 0x40; // System tick the running primitive ends at
+char MQ_motion[MQ_SIZE] @ 0x44;
+char MQ_prio[MQ_SIZE] @ 0x48;
+char MQ_head @ 0x4C;
+char MQ_tail @ 0x4D;
+char MQ_priority @ 0x4E; // Of the running primitive
+char MQ_tag[MQ_SIZE]; // Caller's label for each primitive, the TDP state here
+char MQ_preempted_tag; // Set by MQ_flush() to what it cut short
+unsigned int MQ_preempted_remaining; // ms
 
 // MC Module
+unsigned int MC_turn_ms[2] = {MC_DEFAULT_TURN_MS, MC_DEFAULT_TURN_MS}; // Full turn, left and right
+
+// Turn Calibration
+char last_pull_trigger = 0; // Followed in both modes, so only a press made in auto counts
 
 void main(void) {
+    // Absolute objects are not cleared by the runtime startup
+    ISR_flags.all = 0;
+    SYS_tick_high = 0;
+    high_pulse = MIN_HIGH;
+    PWM_counter = 0;
+    WD_echo_done = 0;
+    WD_probe_mask = 0;
+    WD_last_pins = 0;
+    MQ_head = 0;
+    MQ_tail = 0;
+    CAL_load(); // An empty EEPROM keeps the defaults until OK is pressed in auto
+    
     // Initialize RC0 and RC1 for mode and pull_trigger, and RC6:4 for RGB
     ANSEL = 0;
     ANSELH = 0;
@@ -131,212 +267,97 @@ void main(void) {
     PORTC = 0;
     PORTD = 0;
     
-    // Init Timer 0
-    T0CS = 0;
-    PSA = 0;
-    OPTION_REG &= 0b11111000; // Prescaler of 2
-    
     // Init Timer 1
     TMR1GE = 0; TMR1ON = 1; 			//Enable TIMER1 (See Fig. 6-1 TIMER1 Block Diagram in PIC16F887 Data Sheet)
 	TMR1CS = 0; 					//Select internal clock whose frequency is Fosc/4, where Fosc = 8 MHz
 	T1CKPS1 = 1; T1CKPS0 = 1; 		 	//Set prescale to divide by 8 yielding a clock tick period of 4 microseconds
+    TMR1IF = 0;
+    TMR1IE = 1; // Overflows extend Timer1 to the 32-bit system tick
     
     // Init CCP1 for PWM
     CCP1M3 = 1; CCP1M2 = 0; CCP1M1 = 1; CCP1M0 = 0;
-    CCP1IE = 1;
 	CCP1IF = 0;
     
-    // Init CCP2 for trigger timeout
+    // Init CCP2 for the motion queue executor
     CCP2M3 = 1; CCP2M2 = 0; CCP2M1 = 1; CCP2M0 = 0;
-    CCP2IE = 0; // We don't enable the interrupt yet
 	CCP2IF = 0;
+    CCP2IE = 1; // Always on, MQ_kick() arms the executor
+    
+    // Turn on Interrupts, the system tick runs from here on
+    PEIE = 1;
+	GIE = 1;
     
     // RGB Module
     system_state = SYSTEM_INIT;
     R = 1; G = 1; B = 0;
     // Delay 1 minute to prepare the sensors
-    long i = 1;
+    unsigned long warmup_deadline = SYS_now() + SYS_MS(TDP_WARMUP_MS);
     while (nTDP_Delay_Override) {
-        if (i == TDP_ONE_MIN) {
+        if (SYS_expired(warmup_deadline)) {
             break;
-        } else {
-            i++;
         }
     }
     system_state = SYSTEM_MANUAL;
     
-    // Turn on Interrupts
+    // Start the servo PWM
     CCPR1 = CCPR1 + 100;
-    PEIE = 1;
-	GIE = 1;
+    CCP1IE = 1;
+    
+    // Init Timer 2 for the 1ms event tick
+    PR2 = EV_MS_PR2;
+    T2CKPS1 = 1; T2CKPS0 = 0; // Prescale 16
+    TMR2IF = 0;
+    TMR2IE = 1;
+    TMR2ON = 1;
+    
     while (1) {
+        // Idle until the ISR posts an event. Sleeping is no option here: Timer1
+        // runs from Fosc and stops in sleep, and the servo PWM and the motion
+        // queue need it.
+        while ((EV_ms | EV_echo | EV_motion) == 0) {}
+        
+        // Evaluate a finished ping cycle as soon as its last echo is back
+        if (EV_echo) {
+            EV_echo = 0;
+            if (mode) {
+                WD_service();
+            }
+        }
+        
+        // Keep the next search primitive queued without waiting for the tick
+        if (EV_motion) {
+            EV_motion = 0;
+            if (mode) {
+                TDP_service();
+            }
+        }
+        
+        // Everything below polls inputs without a change interrupt or runs on
+        // deadlines, once per 1ms tick
+        if (EV_ms == 0) {
+            continue;
+        }
+        EV_ms = 0;
+        
         if (mode) {
             // This is auto mode
-            switch (WD_state) {
-                case Left_Out:
-                    TRISB0 = 0;
-                    if (WD_probe_sent) {
-                        if (WD_probe_finished) {
-                            WD_LEFT = 0;
-                            T0IE = 0;
-                            WD_state = Left_In;
-                            IOCB0 = 1;
-                            WD_LEFT = WD_LEFT;
-                            RBIF = 0;
-                            RBIE = 1;
-                        }
-                    } else {
-                        TMR0 = WD_10us;
-                        WD_LEFT = 1;
-                        T0IF = 0;
-                        T0IE = 1;
-                        WD_probe_sent = 1;
-                    }
-                    break;
-                case Left_In:
-                    TRISB0 = 1;
-                    if (WD_feedback_received) {
-                        IOCB = 0;
-                        RBIE = 0;
-                        if (last_FE_time - last_RE_time > WD_Collision_Threshold) {
-                            TDP_evade_left();
-                        }
-                        WD_state = Center_Out;
-                    }
-                    break;
-                case Center_Out:
-                    TRISB1 = 0;
-                    if (WD_probe_sent) {
-                        if (WD_probe_finished) {
-                            WD_CENTER = 0;
-                            T0IE = 0;
-                            WD_state = Center_In;
-                            IOCB1 = 1;
-                            WD_CENTER = WD_CENTER;
-                            RBIF = 0;
-                            RBIE = 1;
-                        }
-                    } else {
-                        TMR0 = WD_10us;
-                        WD_CENTER = 1;
-                        T0IF = 0;
-                        T0IE = 1;
-                        WD_probe_sent = 1;
-                    }
-                    break;
-                case Center_In:
-                    TRISB1 = 1;
-                    if (WD_feedback_received) {
-                        IOCB = 0;
-                        RBIE = 0;
-                        if (last_FE_time - last_RE_time > WD_Collision_Threshold) {
-                            TDP_evade_center();
-                        }
-                        WD_state = Right_Out;
-                    }
-                    break;
-                case Right_Out:
-                    TRISB2 = 0;
-                    if (WD_probe_sent) {
-                        if (WD_probe_finished) {
-                            WD_RIGHT = 0;
-                            T0IE = 0;
-                            WD_state = Right_In;
-                            IOCB2 = 1;
-                            WD_RIGHT = WD_RIGHT;
-                            RBIF = 0;
-                            RBIE = 1;
-                        }
-                    } else {
-                        TMR0 = WD_10us;
-                        WD_RIGHT = 1;
-                        T0IF = 0;
-                        T0IE = 1;
-                        WD_probe_sent = 1;
-                    }
-                    break;
-                case Right_In:
-                    TRISB2 = 1;
-                    if (WD_feedback_received) {
-                        IOCB = 0;
-                        RBIE = 0;
-                        if (last_FE_time - last_RE_time > WD_Collision_Threshold) {
-                            TDP_evade_right();
-                        }
-                        WD_state = Left_Out;
-                    }
-                    break;
+            // Pressing OK (pull_trigger, unused in auto) calibrates the turns.
+            // Never on its own, it blocks and would eat into a match.
+            if (pull_trigger & (last_pull_trigger == 0)) {
+                CAL_run();
             }
+            last_pull_trigger = pull_trigger;
             
-            if (TDP_CENTER) {
-                system_state = SYSTEM_ENGAGED;
-                MC_OUT = Go_Forward;
-                TDP_state = TDP_Standby;
-                TDP_counter = 0;
-            } else {
-                system_state = SYSTEM_SEARCHING;
-                if (TDP_LEFT) {
-                    MC_OUT = Turn_Right;
-                    TDP_state = TDP_Standby;
-                    last_direction = 0;
-                    CCP2IE = 0;
-                } else if (TDP_RIGHT) {
-                    MC_OUT = Turn_Left;
-                    TDP_state = TDP_Standby;
-                    last_direction = 1;
-                    CCP2IE = 0;
-                } else {
-                    // TDP FSM
-                    switch (TDP_state) {
-                        case TDP_Standby:
-                            if (last_direction) {
-                                TDP_state = RIGHT90;
-                            } else {
-                                TDP_state = LEFT90;
-                            }
-                            TDP_counter = 0;
-                            break;
-                        case LEFT90:
-                            MC_OUT = Turn_Left;
-                            if (CCP2IE == 0) {
-                                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                                CCP2IE = 1;
-                            }
-                            break;
-                        case RIGHT90:
-                            MC_OUT = Turn_Right;
-                            if (CCP2IE == 0) {
-                                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                                CCP2IE = 1;
-                            }
-                            break;
-                        case LEFT180:
-                            MC_OUT = Turn_Left;
-                            if (CCP2IE == 0) {
-                                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                                CCP2IE = 1;
-                            }
-                            break;
-                        case RIGHT180:
-                            MC_OUT = Turn_Right;
-                            if (CCP2IE == 0) {
-                                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                                CCP2IE = 1;
-                            }
-                            break;
-                        case TDP_Engaged:
-                            MC_OUT = Go_Forward;
-                            if (CCP2IE == 0) {
-                                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                                CCP2IE = 1;
-                            }
-                            break;
-                    }
-                }
-            }
+            WD_service();
+            TDP_service();
         } else {
             system_state = SYSTEM_MANUAL;
             TDP_state = TDP_Standby;
+            TDP_saved_state = TDP_Standby;
+            if (MQ_active) {
+                MQ_stop();
+            }
+            last_pull_trigger = pull_trigger;
         }
         
         // System Main FSM
@@ -362,21 +383,20 @@ void main(void) {
             case Trigger_StandBy:
                 if ((mode & trigger_under_auto) | (~mode & pull_trigger)) {
                     trigger_state = Trigger_Pulled;
-                    trigger_counter = 0;
+                    trigger_deadline = SYS_now() + SYS_MS(TRIG_DELAY_MS);
                 }
                 high_pulse = MIN_HIGH;
                 break;
             case Trigger_Pulled:
-                if (CCP2IE == 0) {
-                    CCPR2 = CCPR2 + TWOFIFTY_MS;
-                    CCP2IE = 1;
+                if (SYS_expired(trigger_deadline)) {
+                    trigger_state = Trigger_CoolDown;
+                    trigger_deadline += SYS_MS(TRIG_COOLDOWN_MS);
                 }
                 high_pulse = MAX_HIGH;
                 break;
             case Trigger_CoolDown:
-                if (CCP2IE == 0) {
-                    CCPR2 = CCPR2 + TWOFIFTY_MS;
-                    CCP2IE = 1;
+                if (SYS_expired(trigger_deadline)) {
+                    trigger_state = Trigger_StandBy;
                 }
                 high_pulse = MIN_HIGH;
                 break;
@@ -384,43 +404,451 @@ void main(void) {
     }
 }
 
-void TDP_evade_left() {
-    CCPR2 = CCPR2 + TWOFIFTY_MS;
-    TDP_saved_state = TDP_state;
-    TDP_state = TDP_Evade_Left1;
-    TDP_evade_counter = 0;
-    if (CCP2IE == 0) {
-        CCP2IE = 1;
+// Atomic read of the system tick from main loop context
+unsigned long SYS_now() {
+    unsigned int high;
+    unsigned int low;
+    
+    // Interrupts off, not just TMR1IE: any other interrupt would count a
+    // pending overflow too, between the two halves being read
+    di();
+    high = SYS_tick_high;
+    low = TMR1H << 8;
+    low |= TMR1L;
+    if (TMR1H != (low >> 8)) {
+        low = TMR1H << 8;
+        low |= TMR1L;
+    }
+    if (TMR1IF & (low < 0x8000)) {
+        high++; // Overflowed, but not counted yet
+    }
+    ei();
+    return ((unsigned long) high << 16) | low;
+}
+
+unsigned long SYS_elapsed(unsigned long since) {
+    return SYS_now() - since;
+}
+
+char SYS_expired(unsigned long deadline) {
+    return (signed long) (SYS_now() - deadline) >= 0;
+}
+
+// Queue a primitive of duration ms, or MQ_HOLD. Returns 0 if the queue is full.
+char MQ_push(char motion, unsigned int duration, char priority, char tag) {
+    char slot;
+    
+    if (MQ_active & (priority > MQ_priority)) {
+        MQ_flush(); // Preempt, the running primitive included
+    }
+    if (MQ_pending() == MQ_SIZE - 1) {
+        return 0; // The last free slot still holds the running primitive
+    }
+    slot = MQ_tail & (MQ_SIZE - 1);
+    MQ_motion[slot] = motion;
+    MQ_ticks[slot] = SYS_MS(duration);
+    MQ_prio[slot] = priority;
+    MQ_tag[slot] = tag;
+    MQ_tail++;
+    if (MQ_active == 0) {
+        MQ_kick();
+    }
+    return 1;
+}
+
+// Primitives queued behind the running one
+char MQ_pending() {
+    return MQ_tail - MQ_head;
+}
+
+// Drop the running primitive and everything queued behind it, leaving MC_OUT
+// as it is for the next push to take over without a gap
+void MQ_flush() {
+    char slot;
+    unsigned long left;
+    
+    MQ_armed = 0; // Hold the executor still while the queue is emptied
+    MQ_preempted_tag = MQ_NO_TAG;
+    MQ_preempted_remaining = 0;
+    if (MQ_active) {
+        slot = (MQ_head - 1) & (MQ_SIZE - 1);
+        MQ_preempted_tag = MQ_tag[slot];
+        left = MQ_end - SYS_now();
+        if ((MQ_ticks[slot] != MQ_HOLD) & ((signed long) left > 0)) {
+            MQ_preempted_remaining = left / SYS_TICKS_PER_MS;
+        }
+    }
+    MQ_head = MQ_tail;
+    MQ_active = 0;
+}
+
+// Flush and have the executor stop the motors
+void MQ_stop() {
+    MQ_flush();
+    MQ_kick();
+}
+
+// Hand the queue to the executor right away, it starts at the next primitive
+void MQ_kick() {
+    MQ_end = SYS_now();
+    MQ_active = 1;
+    MQ_armed = 1;
+    CCP2IF = 1;
+}
+
+// Follow the target while it's in view, otherwise keep the search sweep queued
+void TDP_service() {
+    char motion;
+    
+    motion = Stop;
+    if (TDP_CENTER) {
+        system_state = SYSTEM_ENGAGED;
+        motion = Go_Forward;
+    } else {
+        system_state = SYSTEM_SEARCHING;
+        if (TDP_LEFT) {
+            motion = Turn_Right;
+            last_direction = 0;
+        } else if (TDP_RIGHT) {
+            motion = Turn_Left;
+            last_direction = 1;
+        }
+    }
+    
+    if (motion != Stop) {
+        if ((MQ_active == 0) | (MQ_priority != MQ_PRIO_TRACK) | (MC_OUT != motion)) {
+            MQ_flush();
+            MQ_push(motion, MQ_HOLD, MQ_PRIO_TRACK, TDP_Engaged);
+        }
+        TDP_state = TDP_Standby;
+    } else {
+        if (MQ_active & (MQ_priority == MQ_PRIO_TRACK)) {
+            MQ_flush(); // Target lost, TDP_plan() takes over below
+        }
+        // TDP FSM, keep the next search primitive queued behind the running one
+        if (MQ_pending() == 0) {
+            TDP_plan();
+        }
+    }
+}
+
+// Turns are given in degrees, scaled by this robot's full turn time
+unsigned int TDP_duration(char state) {
+    const TDP_Transition *tdp;
+    
+    tdp = &TDP_table[state];
+    if ((tdp->motion == Turn_Left) | (tdp->motion == Turn_Right)) {
+        return (unsigned long) tdp->amount * MC_turn_ms[tdp->motion - Turn_Left] / 360;
+    }
+    return tdp->amount;
+}
+
+// Queue the next search primitive behind whatever is running
+void TDP_plan() {
+    TDP_state = TDP_table[TDP_state].next;
+    if (TDP_state == TDP_Standby) {
+        if (last_direction) {
+            TDP_state = RIGHT90;
+        } else {
+            TDP_state = LEFT90;
+        }
+    }
+    MQ_push(TDP_table[TDP_state].motion, TDP_duration(TDP_state), MQ_PRIO_SEARCH, TDP_state);
+}
+
+// Queue both evade stages, then the rest of the search step they cut short
+void TDP_evade(char state) {
+    if (MQ_active & (MQ_priority > MQ_PRIO_EVADE)) {
+        return;
+    }
+    MQ_flush();
+    if (MQ_preempted_tag < TDP_Standby) {
+        TDP_saved_state = MQ_preempted_tag;
+        TDP_saved_remaining = MQ_preempted_remaining;
+    } else if (MQ_preempted_tag == MQ_NO_TAG) {
+        TDP_saved_state = TDP_Standby;
+    }
+    // Evading again mid-evade keeps what the first evade saved
+    MQ_push(TDP_table[state].motion, TDP_duration(state), MQ_PRIO_EVADE, state);
+    state = TDP_table[state].next;
+    MQ_push(TDP_table[state].motion, TDP_duration(state), MQ_PRIO_EVADE, state);
+    TDP_state = state;
+    if (TDP_saved_state != TDP_Standby) {
+        TDP_state = TDP_saved_state;
+        if (TDP_saved_remaining != 0) {
+            MQ_push(TDP_table[TDP_state].motion, TDP_saved_remaining, MQ_PRIO_EVADE, TDP_state);
+        }
+    }
+}
+
+// Returns 0 and keeps the defaults if the EEPROM holds no plausible turn times
+char CAL_load() {
+    unsigned int left_ms;
+    unsigned int right_ms;
+    
+    if (eeprom_read(CAL_EE_BASE) != CAL_EE_MAGIC) {
+        return 0;
+    }
+    left_ms = eeprom_read(CAL_EE_BASE + 1) | (eeprom_read(CAL_EE_BASE + 2) << 8);
+    right_ms = eeprom_read(CAL_EE_BASE + 3) | (eeprom_read(CAL_EE_BASE + 4) << 8);
+    if ((left_ms < CAL_MIN_TURN_MS) | (left_ms > CAL_MAX_TURN_MS) | (right_ms < CAL_MIN_TURN_MS) | (right_ms > CAL_MAX_TURN_MS)) {
+        return 0;
+    }
+    MC_turn_ms[0] = left_ms;
+    MC_turn_ms[1] = right_ms;
+    return 1;
+}
+
+void CAL_store() {
+    eeprom_write(CAL_EE_BASE, 0xFF); // A reset mid-write must not leave valid looking data
+    eeprom_write(CAL_EE_BASE + 1, MC_turn_ms[0]);
+    eeprom_write(CAL_EE_BASE + 2, MC_turn_ms[0] >> 8);
+    eeprom_write(CAL_EE_BASE + 3, MC_turn_ms[1]);
+    eeprom_write(CAL_EE_BASE + 4, MC_turn_ms[1] >> 8);
+    eeprom_write(CAL_EE_BASE, CAL_EE_MAGIC);
+}
+
+// Blocks for up to a minute, the pings keep running but the search doesn't.
+// Switching to manual aborts it and keeps the old turn times.
+void CAL_run() {
+    unsigned long deadline;
+    unsigned int reference;
+    unsigned int left_ms;
+    unsigned int right_ms;
+    unsigned int diff;
+    
+    R = 1; G = 1; B = 1; // White while calibrating
+    CAL_hold(Stop);
+    deadline = SYS_now() + SYS_MS(CAL_SETTLE_MS);
+    while (CAL_sample(deadline)) {}
+    if (CAL_sample(SYS_now() + SYS_MS(CAL_SAMPLE_MS)) & (WD_range[WD_SENSOR_CENTER] < CAL_Reference_Max)) {
+        reference = WD_range[WD_SENSOR_CENTER];
+        left_ms = CAL_measure(Turn_Left, reference);
+        right_ms = CAL_measure(Turn_Right, reference);
+        // Both ways turn about as fast, a wide mismatch means a bad reference
+        if (left_ms > right_ms) {
+            diff = left_ms - right_ms;
+        } else {
+            diff = right_ms - left_ms;
+        }
+        if ((left_ms >= CAL_MIN_TURN_MS) & (left_ms <= CAL_MAX_TURN_MS) & (right_ms >= CAL_MIN_TURN_MS) & (right_ms <= CAL_MAX_TURN_MS)
+                & ((unsigned long) diff * 100 <= (unsigned long) left_ms * CAL_MATCH_PERCENT)) {
+            MC_turn_ms[0] = left_ms;
+            MC_turn_ms[1] = right_ms;
+            CAL_store();
+        }
+    }
+    MQ_stop();
+    TDP_state = TDP_Standby;
+    TDP_saved_state = TDP_Standby;
+}
+
+// Calibration outranks everything, so WD_service() can't start an evade meanwhile
+void CAL_hold(char motion) {
+    MQ_flush();
+    MQ_push(motion, MQ_HOLD, MQ_PRIO_CALIBRATE, TDP_Standby);
+}
+
+// Run the pings until the centre sensor has a new range, 0 if the deadline
+// passes or the mode switch drops first
+char CAL_sample(unsigned long deadline) {
+    while (mode & !SYS_expired(deadline)) {
+        WD_service();
+        if (WD_updated & (1 << WD_SENSOR_CENTER)) {
+            WD_updated &= ~(1 << WD_SENSOR_CENTER);
+            return 1;
+        }
     }
-    MC_OUT = Turn_Right;
+    return 0;
 }
 
-void TDP_evade_center() {
-    CCPR2 = CCPR2 + TWOFIFTY_MS;
-    TDP_saved_state = TDP_state;
-    TDP_state = TDP_Evade_Center1;
-    TDP_evade_counter = 0;
-    if (CCP2IE == 0) {
-        CCP2IE = 1;
+char CAL_near(unsigned int reference) {
+    unsigned int range;
+    
+    range = WD_range[WD_SENSOR_CENTER];
+    if (range > reference) {
+        return range - reference <= CAL_Tolerance;
     }
-    MC_OUT = Turn_Left;
+    return reference - range <= CAL_Tolerance;
 }
 
-void TDP_evade_right() {
-    CCPR2 = CCPR2 + TWOFIFTY_MS;
-    TDP_saved_state = TDP_state;
-    TDP_state = TDP_Evade_Right1;
-    TDP_evade_counter = 0;
-    if (CCP2IE == 0) {
-        CCP2IE = 1;
+// Full turn time in ms, 0 on timeout or abort. Timing from one drop-out of the
+// reference to the next cancels the beam width and the lag of the median
+// filter. Only a reference held in view for CAL_HOLD_MS counts, so a single
+// echo off something else at the same range can't end the turn early.
+unsigned int CAL_measure(char motion, unsigned int reference) {
+    unsigned long deadline;
+    unsigned long left_at;
+    unsigned long seen_at;
+    char inside;
+    char drops;
+    
+    CAL_hold(Stop);
+    deadline = SYS_now() + SYS_MS(CAL_SETTLE_MS);
+    while (CAL_sample(deadline)) {}
+    inside = CAL_near(reference);
+    seen_at = SYS_now() - SYS_MS(CAL_HOLD_MS); // Standing still in view, already held
+    drops = 0;
+    CAL_hold(motion);
+    deadline = SYS_now() + SYS_MS(CAL_TIMEOUT_MS);
+    while (CAL_sample(deadline)) {
+        if (CAL_near(reference)) {
+            if (inside == 0) {
+                inside = 1;
+                seen_at = SYS_now();
+            }
+        } else if (inside) {
+            inside = 0;
+            if (SYS_now() - seen_at < SYS_MS(CAL_HOLD_MS)) {
+                continue;
+            }
+            drops++;
+            if (drops == 1) {
+                left_at = SYS_now();
+            } else {
+                CAL_hold(Stop);
+                return (SYS_now() - left_at) / SYS_TICKS_PER_MS;
+            }
+        }
     }
-    MC_OUT = Turn_Left;
+    CAL_hold(Stop);
+    return 0;
+}
+
+void WD_service() {
+    unsigned long elapsed;
+    unsigned int gap;
+    char i;
+    char sensor;
+    char other;
+    char pin;
+    char crosstalk;
+    char evade;
+    
+    elapsed = SYS_elapsed(WD_cycle_start);
+    if (((WD_fired == 0b111) & (WD_echo_done == 0b111)) | (elapsed > WD_Cycle_Timeout)) {
+        evade = 0;
+        for (i = 0; i < 3; i++) {
+            sensor = WD_priority[i];
+            pin = 1 << sensor;
+            if ((WD_echo_done & pin) == 0) {
+                continue;
+            }
+            // An echo ending together with one of an earlier ping is that ping's
+            // burst heard by the wrong sensor, not a reflection of our own
+            crosstalk = 0;
+            for (other = 0; other < 3; other++) {
+                if ((other != sensor) & ((WD_echo_done & (1 << other)) != 0) & (WD_offset[other] < WD_offset[sensor])) {
+                    gap = WD_fall_time[sensor] - WD_fall_time[other];
+                    if ((gap < WD_Crosstalk_Window) | (gap > (unsigned int) -WD_Crosstalk_Window)) {
+                        crosstalk = 1;
+                    }
+                }
+            }
+            if (crosstalk) {
+                continue;
+            }
+            WD_updated |= pin;
+            if (WD_update(sensor, WD_fall_time[sensor] - WD_rise_time[sensor], SYS_now()) & (evade == 0)) {
+                evade = 1;
+                TDP_evade(WD_evade_state[sensor]);
+            }
+        }
+        
+        RBIE = 0;
+        IOCB = 0;
+        WD_probe_mask = 0;
+        WD_last_pins = 0;
+        WD_echo_done = 0;
+        WD_fired = 0;
+        WD_cycle_start = SYS_now();
+        elapsed = 0;
+    }
+    
+    for (sensor = WD_SENSOR_LEFT; sensor <= WD_SENSOR_RIGHT; sensor++) {
+        pin = 1 << sensor;
+        if (((WD_fired & pin) == 0) & (elapsed >= WD_offset[sensor])) {
+            WD_fire(sensor);
+            WD_fired |= pin;
+        }
+    }
+}
+
+// Trigger one sensor and listen for its echo on the same pin
+void WD_fire(char sensor) {
+    unsigned int now;
+    char pin;
+    char pins;
+    
+    pin = 1 << sensor;
+    RBIE = 0;
+    TRISB &= ~pin;
+    PORTB |= pin;
+    _delay(WD_Trigger_Width * 2); // 2 instruction cycles per us at 8MHz
+    PORTB &= ~pin;
+    TRISB |= pin;
+    now = TMR1H << 8;
+    now |= TMR1L;
+    if (TMR1H != (now >> 8)) {
+        now = TMR1H << 8;
+        now |= TMR1L;
+    }
+    WD_rise_time[sensor] = now; // In case the rising edge is missed
+    IOCB |= pin;
+    WD_probe_mask |= pin;
+    pins = PORTB & WD_probe_mask; // Also ends any pending mismatch
+    RBIF = 0;
+    // The other sensors' edges during the pulse are still pending, attribute
+    // them as the ISR would, a trigger pulse late at most
+    if (WD_echo_edges(pins & ~pin, now)) {
+        EV_echo = 1;
+    }
+    WD_last_pins = pins;
+    RBIE = 1;
 }
 
 void interrupt interrupt_handler() {
-    if (T0IF) {
-        WD_probe_finished = 1;
-        T0IF = 0;
+    unsigned int now;
+    unsigned int high;
+    char slot;
+    
+    // Timestamp on entry and serve echoes first, so an echo edge is not timed
+    // after the CCP branches of this pass. An edge that comes while the ISR is
+    // already running still waits for it, up to one full pass (the isr budget,
+    // 250 cycles) plus entry, and then possibly for the rest of a WD_fire()
+    // with RBIE off (60 cycles): 330 cycles or 42 ticks with the stamp
+    // rounding. A width is out by at most +-42 ticks (2.9cm), well inside
+    // WD_Collision_Threshold. tools/wd_check models this and checks the bound.
+    // TMR1L rolling over between the two byte reads would put the stamp 256
+    // ticks out, so reread when TMR1H moved.
+    now = TMR1H << 8;
+    now |= TMR1L;
+    if (TMR1H != (now >> 8)) {
+        now = TMR1H << 8;
+        now |= TMR1L;
+    }
+    // Upper half for the same instant, taken before the TMR1IF branch below
+    // counts the overflow, which would then be added twice.
+    high = SYS_tick_high;
+    if (TMR1IF & (now < 0x8000)) {
+        high++;
+    }
+    
+    if (RBIF) {
+        if (WD_echo_edges(PORTB & WD_probe_mask, now)) {
+            EV_echo = 1;
+        }
+        RBIF = 0;
+    }
+    
+    if (TMR1IF) {
+        SYS_tick_high++;
+        TMR1IF = 0;
+    }
+    
+    if (TMR2IF) {
+        EV_ms = 1;
+        TMR2IF = 0;
     }
     
     if (CCP1IF) {
@@ -451,142 +879,31 @@ void interrupt interrupt_handler() {
             PWM_counter++;
         }
         CCP1IF = 0;
-    }
-    
+    }    
     if (CCP2IF) {
-        CCPR2 = CCPR2 + TWOFIFTY_MS;
-        switch (trigger_state) {
-            case Trigger_Pulled:
-                if (trigger_counter == TRIG_DELAY_MULTIPLIER) {
-                    trigger_state = Trigger_CoolDown;
-                    trigger_counter = 0;
-                    CCP2IE = 0;
-                } else {
-                    trigger_counter++;
-                }
-                break;
-            case Trigger_CoolDown:
-                if (trigger_counter == TRIG_COOLDOWN_MULTIPLIER) {
-                    trigger_state = Trigger_StandBy;
-                    CCP2IE = 0;
-                } else {
-                    trigger_counter++;
-                }
-                break;
-        }
-        switch (TDP_state) {
-            case LEFT90:
-                if (TDP_counter == NINTY_DEG_COUNT) {
-                    TDP_state = RIGHT180;
-                    TDP_counter = 0;
-                    CCP2IE = 0;
-                } else {
-                    TDP_counter++;
-                }
-                break;
-            case RIGHT90:
-                if (TDP_counter == NINTY_DEG_COUNT) {
-                    TDP_state = LEFT180;
-                    TDP_counter = 0;
-                    CCP2IE = 0;
-                } else {
-                    TDP_counter++;
-                }
-                break;
-            case LEFT180:
-                if (TDP_counter == ONEEIGHTY_DEG_COUNT) {
-                    TDP_state = RIGHT180;
-                    TDP_counter = 0;
-                    CCP2IE = 0;
-                } else {
-                    TDP_counter++;
-                }
-                break;
-            case RIGHT180:
-                if (TDP_counter == ONEEIGHTY_DEG_COUNT) {
-                    TDP_state = LEFT180;
-                    TDP_counter = 0;
-                    CCP2IE = 0;
-                } else {
-                    TDP_counter++;
-                }
-                break;
-            case TDP_Engaged:
-                 if (TDP_counter == ENGAGED_DELAY) {
-                    TDP_state = TDP_Standby;
-                    TDP_counter = 0;
-                    CCP2IE = 0;
-                } else {
-                    TDP_counter++;
-                }
-                break;
-            case TDP_Evade_Left1:
-                if (TDP_evade_counter == FORTYFIVE_DEG_COUNT) {
-                    TDP_state = TDP_Evade_Left2;
-                    TDP_evade_counter = 0;
-                    MC_OUT = Go_Forward;
+        // Motion queue executor. CCPR2 holds the low half of MQ_end, the running
+        // primitive is over once the high half has been reached too.
+        // Unarmed, CCP2 still matches once a TMR1 wrap and is just cleared.
+        if (MQ_armed & ((signed int) (high - (unsigned int) (MQ_end >> 16)) >= 0)) {
+            if (MQ_head != MQ_tail) {
+                slot = MQ_head & (MQ_SIZE - 1);
+                MC_OUT = MQ_motion[slot];
+                MQ_priority = MQ_prio[slot];
+                if (MQ_ticks[slot] == MQ_HOLD) {
+                    MQ_armed = 0;
                 } else {
-                    TDP_evade_counter++;
+                    // Chained from the last end, not from now, so durations are exact
+                    MQ_end += MQ_ticks[slot];
+                    CCPR2 = (unsigned int) MQ_end;
                 }
-                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                break;
-            case TDP_Evade_Left2:
-                if (TDP_evade_counter == FORTYFIVE_DEG_COUNT) {
-                    TDP_state = TDP_saved_state;
-                    TDP_evade_counter = 0;
-                } else {
-                    TDP_evade_counter++;
-                }
-                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                break;
-            case TDP_Evade_Center1:
-                if (TDP_evade_counter == NINTY_DEG_COUNT) {
-                    TDP_state = TDP_Evade_Center2;
-                    TDP_evade_counter = 0;
-                    MC_OUT = Go_Forward;
-                } else {
-                    TDP_evade_counter++;
-                }
-                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                break;
-            case TDP_Evade_Center2:
-                if (TDP_evade_counter == FORTYFIVE_DEG_COUNT) {
-                    TDP_state = TDP_saved_state;
-                    TDP_evade_counter = 0;
-                } else {
-                    TDP_evade_counter++;
-                }
-                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                break;
-            case TDP_Evade_Right1:
-                if (TDP_evade_counter == FORTYFIVE_DEG_COUNT) {
-                    TDP_state = TDP_Evade_Right2;
-                    TDP_evade_counter = 0;
-                    MC_OUT = Go_Forward;
-                } else {
-                    TDP_evade_counter++;
-                }
-                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                break;
-            case TDP_Evade_Right2:
-                if (TDP_evade_counter == FORTYFIVE_DEG_COUNT) {
-                    TDP_state = TDP_saved_state;
-                    TDP_evade_counter = 0;
-                } else {
-                    TDP_evade_counter++;
-                }
-                CCPR2 = CCPR2 + TWOFIFTY_MS;
-                break;
+                MQ_head++;
+            } else {
+                MC_OUT = Stop;
+                MQ_active = 0;
+                MQ_armed = 0;
+            }
+            EV_motion = 1;
         }
         CCP2IF = 0;
     }
-    
-    if (RBIF) {
-        last_RE_time = last_FE_time;
-        last_FE_time = TMR1;
-        WD_last_left = WD_LEFT;
-        WD_last_center = WD_CENTER;
-        WD_last_right = WD_RIGHT;
-        RBIF = 0;
-    }
-}
\ No newline at end of file
+}
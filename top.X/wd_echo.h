@@ -0,0 +1,134 @@
+/*
+ * File:   wd_echo.h
+ *
+ * Ultrasonic echo timing and range filter shared by the top firmware and the
+ * host check in tools/. It defines its state, so include it from exactly one
+ * file, after defining WD_rise_time, WD_fall_time, WD_echo_done and
+ * WD_last_pins (the ISR's view of the echo pins) and SYS_MS().
+ */
+
+#ifndef WD_ECHO_H
+#define WD_ECHO_H
+
+enum WD_Sensors {WD_SENSOR_LEFT, WD_SENSOR_CENTER, WD_SENSOR_RIGHT};
+#define WD_Collision_Threshold 435 // 30cm * 58us/cm / 4us
+#define WD_HISTORY_SIZE 5 // Odd, so the median is always one of the samples
+#define WD_Max_Range 6000 // 24ms, longer echoes (or none) are treated as open space
+#define WD_TTC_MS 90 // Evade when the threshold will be crossed within this time
+#define WD_CLOSING_MS 100 // WD_closing is the change of WD_range over this time
+#define WD_CLOSING_MAX_GAP_MS 250 // Updates further apart give no closing speed
+
+// WD Module
+unsigned int WD_history[3][WD_HISTORY_SIZE]; // Ring of raw echo widths per sensor
+char WD_history_index[3];
+char WD_history_primed = 0; // One bit per sensor, set once its ring has been filled with WD_Max_Range
+unsigned int WD_range[3]; // Median filtered echo width
+signed int WD_closing[3]; // Ticks of range per WD_CLOSING_MS, positive when closing in
+unsigned long WD_update_time[3]; // System tick of each sensor's last update
+
+// Interrupt-on-change doesn't say which pin moved, compare with the last levels.
+// Stamps each edge with now, returns the pins whose echo just ended. Called
+// from the ISR and from WD_fire(), so XC8 keeps a copy for each.
+char WD_echo_edges(char pins, unsigned int now) {
+    char edges;
+    
+    edges = pins ^ WD_last_pins;
+    WD_last_pins = pins;
+    if (edges & 0b001) {
+        if (pins & 0b001) {
+            WD_rise_time[WD_SENSOR_LEFT] = now;
+        } else {
+            WD_fall_time[WD_SENSOR_LEFT] = now;
+            WD_echo_done |= 0b001;
+        }
+    }
+    if (edges & 0b010) {
+        if (pins & 0b010) {
+            WD_rise_time[WD_SENSOR_CENTER] = now;
+        } else {
+            WD_fall_time[WD_SENSOR_CENTER] = now;
+            WD_echo_done |= 0b010;
+        }
+    }
+    if (edges & 0b100) {
+        if (pins & 0b100) {
+            WD_rise_time[WD_SENSOR_RIGHT] = now;
+        } else {
+            WD_fall_time[WD_SENSOR_RIGHT] = now;
+            WD_echo_done |= 0b100;
+        }
+    }
+    return edges & ~pins;
+}
+
+// Median filter one sensor's new echo width, 1 if it calls for an evade
+char WD_update(char sensor, unsigned int width, unsigned long now) {
+    unsigned int sorted[WD_HISTORY_SIZE];
+    unsigned int sample;
+    unsigned int filtered;
+    unsigned long gap;
+    signed long closing;
+    char i, j;
+    
+    gap = now - WD_update_time[sensor];
+    WD_update_time[sensor] = now;
+    if (width > WD_Max_Range) {
+        width = WD_Max_Range;
+    }
+    
+    if ((WD_history_primed & (1 << sensor)) == 0) {
+        // Start from open space, so it takes a majority of real echoes to move
+        // the median and a spurious first echo can't trigger an evade
+        for (i = 0; i < WD_HISTORY_SIZE; i++) {
+            WD_history[sensor][i] = WD_Max_Range;
+        }
+        WD_range[sensor] = WD_Max_Range;
+        WD_history_primed |= 1 << sensor;
+    }
+    WD_history[sensor][WD_history_index[sensor]] = width;
+    if (WD_history_index[sensor] == WD_HISTORY_SIZE - 1) {
+        WD_history_index[sensor] = 0;
+    } else {
+        WD_history_index[sensor]++;
+    }
+    
+    // Insertion sort a copy of the ring, the middle element is the median.
+    // A single spurious or missing echo can never be the median.
+    for (i = 0; i < WD_HISTORY_SIZE; i++) {
+        sample = WD_history[sensor][i];
+        j = i;
+        while ((j > 0) && (sorted[j-1] > sample)) {
+            sorted[j] = sorted[j-1];
+            j--;
+        }
+        sorted[j] = sample;
+    }
+    filtered = sorted[WD_HISTORY_SIZE / 2];
+    
+    // The ping cycle follows the longest echo, so scale the change by the
+    // time it took. Appearing out of open space, or after a long silence, is
+    // no measure of speed.
+    if ((WD_range[sensor] == WD_Max_Range) | (gap == 0) | (gap > SYS_MS(WD_CLOSING_MAX_GAP_MS))) {
+        closing = 0;
+    } else {
+        closing = (signed long) (signed int) (WD_range[sensor] - filtered) * SYS_MS(WD_CLOSING_MS) / (signed long) gap;
+        if (closing > 0x7FFF) {
+            closing = 0x7FFF;
+        } else if (closing < -0x7FFF) {
+            closing = -0x7FFF;
+        }
+    }
+    WD_closing[sensor] = (signed int) closing;
+    WD_range[sensor] = filtered;
+    
+    if (filtered < WD_Collision_Threshold) {
+        return 1;
+    }
+    // Predicted time to collision: (filtered - threshold) / closing * WD_CLOSING_MS
+    if ((WD_closing[sensor] > 0) && ((unsigned long) (filtered - WD_Collision_Threshold) * WD_CLOSING_MS < (unsigned long) WD_closing[sensor] * WD_TTC_MS)) {
+        return 1;
+    }
+    return 0;
+}
+
+#endif